@@ -4,6 +4,25 @@
 
 #include <iostream>
 #include <vector>
+#include <string>
+#include <string_view>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 class Visitor {
 public:
@@ -16,6 +35,8 @@ class Person {
     
 public:
     Person(const std::string &name, int age) : name(name), age(age) {}
+    const std::string &getName() const { return name; }
+    int getAge() const { return age; }
     std::string accept(Visitor *v) {
         return v->handlePerson(name, age);
     }
@@ -35,13 +56,32 @@ protected:
     }
 public:
     GreetingCardTemplate(const std::string &from) : from(from) {}
-    ~GreetingCardTemplate();
+    ~GreetingCardTemplate() {}
     std::string generateCardFor(Person *person) {
         return person->accept(this);
     }
-    std::string handlePerson(const std::string &name, int age) {
-        return std::string("\nSending this card to " + name + ":\n\n" +
-                           intro(name) + occasion() + closing(from));
+    // Cards are formatted by appendCard, so a template customises that
+    // rather than this, and ParallelCardWriter writes the same cards.
+    std::string handlePerson(const std::string &name, int age) final {
+        std::string card;
+        appendCard(card, name, age, cardTail());
+        return card;
+    }
+    // occasion() + closing(from): the part of the card that is the same
+    // for everyone, worked out once per batch instead of once per card.
+    std::string cardTail() {
+        return occasion() + closing(from);
+    }
+    // Appends the card for one person; `tail` is cardTail(). Called from
+    // several threads at once by ParallelCardWriter, so it mustn't modify
+    // the template.
+    virtual void appendCard(std::string &out, std::string_view name, int /*age*/,
+                            const std::string &tail) {
+        out += "\nSending this card to ";
+        out += name;
+        out += ":\n\n";
+        out += intro(std::string(name));
+        out += tail;
     }
 };
 
@@ -73,14 +113,526 @@ public:
     void setTemplate(GreetingCardTemplate *newTemp) { temp = newTemp; }
     std::vector<std::string> createGreetingCards() {
         std::vector<std::string> list_msgs;
+        list_msgs.reserve(people.size());
         for (auto &person : people) {
             list_msgs.push_back(temp->generateCardFor(person));
         }
         return list_msgs;
     }
 };
-    
-int main() {
+
+// A person as seen by ParallelCardWriter: the name points into storage
+// owned by whoever filled the batch.
+struct PersonView {
+    std::string_view name;
+    int age;
+};
+
+struct PersonBatch {
+    std::vector<PersonView> people;
+    std::string names;          // backing text for sources that make up names
+    void clear() {
+        people.clear();
+        names.clear();
+    }
+};
+
+// Supplies people a batch at a time; read() is only called by one thread
+// at a time. Views have to stay valid until the batch is cleared.
+class PersonSource {
+public:
+    virtual ~PersonSource() {}
+    // Adds up to `count` people to `batch`; returns 0 once the source is
+    // exhausted, and keeps returning 0 after that.
+    virtual size_t read(PersonBatch &batch, size_t count) = 0;
+};
+
+class VectorPersonSource : public PersonSource {
+    const std::vector<Person*> &people;
+    size_t next = 0;
+public:
+    VectorPersonSource(const std::vector<Person*> &people) : people(people) {}
+    size_t read(PersonBatch &batch, size_t count) override {
+        size_t n = std::min(count, people.size() - next);
+        for (size_t i = 0; i < n; ++i, ++next) {
+            batch.people.push_back(PersonView{ people[next]->getName(), people[next]->getAge() });
+        }
+        return n;
+    }
+};
+
+// "Person<i>" for i in [0, count), without keeping them all around.
+class GeneratedPersonSource : public PersonSource {
+    size_t count;
+    size_t next = 0;
+public:
+    GeneratedPersonSource(size_t count) : count(count) {}
+    size_t read(PersonBatch &batch, size_t max) override {
+        size_t n = std::min(max, count - next);
+        size_t first = batch.names.size();
+        std::vector<size_t> ends;
+        ends.reserve(n);
+        char name[32];
+        for (size_t i = 0; i < n; ++i) {
+            int length = std::snprintf(name, sizeof(name), "Person%zu", next + i);
+            batch.names.append(name, length);
+            ends.push_back(batch.names.size());
+        }
+        // views are made once names has stopped growing
+        for (size_t i = 0; i < n; ++i) {
+            size_t begin = i == 0 ? first : ends[i - 1];
+            batch.people.push_back(PersonView{
+                std::string_view(batch.names.data() + begin, ends[i] - begin),
+                static_cast<int>((next + i) % 100) });
+        }
+        next += n;
+        return n;
+    }
+};
+
+// First ',' or '\n' in [p, end), or end. With SSE2 this checks 16 bytes
+// per step; the tail and other targets go a byte at a time.
+const char *findDelimiter(const char *p, const char *end) {
+#if defined(__SSE2__)
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, comma),
+                                                  _mm_cmpeq_epi8(chunk, newline)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    while (p < end && *p != ',' && *p != '\n')
+        ++p;
+    return p;
+}
+
+// A read-only mapping of a file of people. The views handed out by read()
+// point straight into the mapping, so nothing is copied or allocated per
+// person and they stay valid for the life of the source.
+class MappedPersonSource : public PersonSource {
+    void *mapping = nullptr;
+    size_t mappedBytes = 0;
+protected:
+    const char *next = nullptr;
+    const char *end = nullptr;
+    size_t skipped = 0;
+public:
+    MappedPersonSource(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Can't open " << path << "\n";
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            mappedBytes = info.st_size;
+            mapping = mmap(nullptr, mappedBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                std::cerr << "Can't map " << path << "\n";
+                mapping = nullptr;
+                mappedBytes = 0;
+            } else {
+                madvise(mapping, mappedBytes, MADV_SEQUENTIAL);
+                next = static_cast<const char*>(mapping);
+                end = next + mappedBytes;
+            }
+        }
+        close(fd);
+    }
+    ~MappedPersonSource() {
+        if (mapping)
+            munmap(mapping, mappedBytes);
+    }
+    MappedPersonSource(const MappedPersonSource &) = delete;
+    MappedPersonSource &operator=(const MappedPersonSource &) = delete;
+
+    // records that couldn't be parsed and were left out
+    size_t malformed() const {
+        return skipped;
+    }
+};
+
+// "name,age" lines. A leading "name,age" header, '\r\n' line ends and a
+// missing final newline are all accepted. Ages have at most three digits;
+// longer ones are malformed rather than overflowing.
+class CsvPersonSource : public MappedPersonSource {
+    static const int maxAgeDigits = 3;
+public:
+    CsvPersonSource(const std::string &path) : MappedPersonSource(path) {
+        if (end - next >= 8 && std::memcmp(next, "name,age", 8) == 0) {
+            const char *lineEnd = static_cast<const char*>(std::memchr(next, '\n', end - next));
+            next = lineEnd ? lineEnd + 1 : end;
+        }
+    }
+    size_t read(PersonBatch &batch, size_t count) override {
+        size_t n = 0;
+        while (n < count && next < end) {
+            const char *comma = findDelimiter(next, end);
+            if (comma == end || *comma == '\n') {
+                if (comma != next)
+                    skipped++;          // a line without an age
+                next = comma == end ? end : comma + 1;
+                continue;
+            }
+            const char *lineEnd = findDelimiter(comma + 1, end);
+            while (lineEnd < end && *lineEnd != '\n')
+                lineEnd = findDelimiter(lineEnd + 1, end);
+            const char *digitsEnd = lineEnd;
+            if (digitsEnd > comma + 1 && digitsEnd[-1] == '\r')
+                --digitsEnd;
+            int age = 0;
+            const char *d = comma + 1;
+            const char *digitsLimit = std::min(digitsEnd, comma + 1 + maxAgeDigits);
+            for (; d < digitsLimit && *d >= '0' && *d <= '9'; ++d) {
+                age = age * 10 + (*d - '0');
+            }
+            if (d == comma + 1 || d != digitsEnd) {
+                skipped++;
+            } else {
+                batch.people.push_back(PersonView{ std::string_view(next, comma - next), age });
+                n++;
+            }
+            next = lineEnd == end ? end : lineEnd + 1;
+        }
+        return n;
+    }
+};
+
+// "PRSN" followed by records of a one-byte name length, the name, and a
+// native-endian int32 age.
+class BinaryPersonSource : public MappedPersonSource {
+public:
+    static constexpr char magic[4] = { 'P', 'R', 'S', 'N' };
+
+    BinaryPersonSource(const std::string &path) : MappedPersonSource(path) {
+        if (end - next < 4 || std::memcmp(next, magic, 4) != 0) {
+            if (next)
+                std::cerr << path << " is not a binary people file\n";
+            next = end;
+            return;
+        }
+        next += 4;
+    }
+    size_t read(PersonBatch &batch, size_t count) override {
+        size_t n = 0;
+        for (; n < count && next < end; ++n) {
+            size_t length = static_cast<uint8_t>(*next);
+            if (static_cast<size_t>(end - next) < 1 + length + sizeof(int32_t)) {
+                skipped++;              // truncated last record
+                next = end;
+                break;
+            }
+            int32_t age;
+            std::memcpy(&age, next + 1 + length, sizeof(age));
+            batch.people.push_back(PersonView{ std::string_view(next + 1, length), age });
+            next += 1 + length + sizeof(age);
+        }
+        return n;
+    }
+};
+
+MappedPersonSource *openPeopleFile(const std::string &path, bool binary) {
+    if (binary)
+        return new BinaryPersonSource(path);
+    return new CsvPersonSource(path);
+}
+
+// Renders cards on a pool of threads, `batchSize` people at a time, and
+// streams them to a file in the order the source produced the people.
+// Rendered batches wait in memory only until the ones before them are
+// written, and at most `maxPending` of them at a time, so memory stays
+// bounded however many people there are.
+class ParallelCardWriter {
+    GreetingCardTemplate *temp;
+    unsigned threads;
+    size_t batchSize;
+    size_t maxPending;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::mutex sourceMutex;
+    size_t nextSequence;
+    size_t nextToWrite;
+    size_t endSequence;                 // first sequence that came back empty
+    std::map<size_t, std::string> ready;
+    std::vector<std::string> spareBuffers;
+    size_t maxReady;
+
+    void render(PersonSource &source) {
+        PersonBatch batch;
+        std::string text;
+        std::string tail = temp->cardTail();
+        for (;;) {
+            size_t sequence;
+            size_t n;
+            batch.clear();
+            {
+                std::lock_guard<std::mutex> reading(sourceMutex);
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [this] {
+                        return nextSequence < nextToWrite + maxPending || nextSequence >= endSequence;
+                    });
+                    if (nextSequence >= endSequence)
+                        return;
+                    sequence = nextSequence++;
+                }
+                n = source.read(batch, batchSize);
+            }
+            if (n == 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                endSequence = std::min(endSequence, sequence);
+                changed.notify_all();
+                return;
+            }
+            text.clear();
+            for (auto &person : batch.people) {
+                temp->appendCard(text, person.name, person.age, tail);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.emplace(sequence, std::move(text));
+            maxReady = std::max(maxReady, ready.size());
+            text.clear();
+            if (!spareBuffers.empty()) {
+                text = std::move(spareBuffers.back());
+                spareBuffers.pop_back();
+            }
+            changed.notify_all();
+        }
+    }
+public:
+    struct Stats {
+        size_t batches = 0;
+        size_t bytes = 0;
+        size_t maxReady = 0;            // most rendered batches held at once
+    };
+
+    ParallelCardWriter(GreetingCardTemplate *temp, unsigned threads,
+                       size_t batchSize = 4096, size_t maxPending = 0) :
+        temp(temp), threads(threads ? threads : 1), batchSize(batchSize),
+        maxPending(maxPending ? maxPending : 4 * (threads ? threads : 1)) {}
+
+    // Writes a card for everyone in `source` to `path`. Returns false if
+    // the file can't be written.
+    bool write(PersonSource &source, const std::string &path, Stats *stats = nullptr) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Cannot open " << path << " for writing" << std::endl;
+            return false;
+        }
+        nextSequence = 0;
+        nextToWrite = 0;
+        endSequence = SIZE_MAX;
+        ready.clear();
+        spareBuffers.clear();
+        maxReady = 0;
+        size_t bytes = 0;
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back([this, &source] { render(source); });
+        }
+        // this thread is the ordered writer
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            changed.wait(lock, [this] {
+                return ready.count(nextToWrite) || nextToWrite >= endSequence;
+            });
+            if (nextToWrite >= endSequence)
+                break;
+            std::string text = std::move(ready[nextToWrite]);
+            ready.erase(nextToWrite);
+            lock.unlock();
+            out.write(text.data(), text.size());
+            bytes += text.size();
+            lock.lock();
+            spareBuffers.push_back(std::move(text));
+            nextToWrite++;
+            changed.notify_all();
+        }
+        lock.unlock();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        out.flush();
+        if (stats) {
+            stats->batches = nextToWrite;
+            stats->bytes = bytes;
+            stats->maxReady = maxReady;
+        }
+        if (!out) {
+            std::cerr << "Failed writing " << path << std::endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+std::string readFile(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// The parallel writer has to produce exactly what createGreetingCards does.
+bool checkParallelWriter(GreetingCardTemplate *temp, const std::string &path) {
+    std::vector<Person*> people;
+    GreetingCardGenerator generator;
+    generator.setTemplate(temp);
+    for (int i = 0; i < 10000; ++i) {
+        people.push_back(new Person("Person" + std::to_string(i), i % 100));
+        generator.addPerson(people.back());
+    }
+    std::string expected;
+    for (auto &msg : generator.createGreetingCards())
+        expected += msg;
+
+    VectorPersonSource source(people);
+    ParallelCardWriter writer(temp, 4, 100, 3);
+    bool ok = writer.write(source, path) && readFile(path) == expected;
+    for (auto person : people)
+        delete person;
+    std::remove(path.c_str());
+    return ok;
+}
+
+// Writes the same people GeneratedPersonSource makes, as CSV or binary.
+// The binary format stores a name's length in one byte, so a longer name
+// fails the write.
+bool writePeopleFile(const std::string &path, size_t people, bool binary) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Cannot open " << path << " for writing" << std::endl;
+        return false;
+    }
+    GeneratedPersonSource source(people);
+    PersonBatch batch;
+    std::string buffer;
+    if (binary)
+        out.write(BinaryPersonSource::magic, 4);
+    else
+        out << "name,age\n";
+    while (source.read(batch, 4096)) {
+        for (auto &person : batch.people) {
+            if (binary) {
+                if (person.name.size() > 255) {
+                    std::cerr << "Name too long for " << path << ": "
+                              << person.name.size() << " bytes" << std::endl;
+                    return false;
+                }
+                int32_t age = person.age;
+                buffer.push_back(static_cast<char>(person.name.size()));
+                buffer += person.name;
+                buffer.append(reinterpret_cast<const char*>(&age), sizeof(age));
+            } else {
+                buffer += person.name;
+                buffer += ',';
+                buffer += std::to_string(person.age);
+                buffer += '\n';
+            }
+        }
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+        batch.clear();
+    }
+    return static_cast<bool>(out);
+}
+
+// Cards from a CSV or binary file have to match the ones made from the
+// same people in memory.
+bool checkMappedSources(GreetingCardTemplate *temp, const std::string &path) {
+    const size_t people = 10000;
+    std::string cardsPath = path + ".cards";
+    GeneratedPersonSource generated(people);
+    ParallelCardWriter writer(temp, 2, 256);
+    if (!writer.write(generated, cardsPath))
+        return false;
+    std::string expected = readFile(cardsPath);
+    bool ok = true;
+    for (bool binary : { false, true }) {
+        if (!writePeopleFile(path, people, binary))
+            return false;
+        MappedPersonSource *source = openPeopleFile(path, binary);
+        ok = writer.write(*source, cardsPath) && source->malformed() == 0 &&
+             readFile(cardsPath) == expected && ok;
+        delete source;
+    }
+    // an age too long to be real is a malformed row, not an overflow
+    std::ofstream(path, std::ios::trunc) << "Ann,30\nBob,99999999999999\nCy,1000\nDee,7\n";
+    CsvPersonSource csv(path);
+    PersonBatch batch;
+    ok = csv.read(batch, 10) == 2 && csv.malformed() == 2 &&
+         batch.people[1].name == "Dee" && batch.people[1].age == 7 && ok;
+    std::remove(path.c_str());
+    std::remove(cardsPath.c_str());
+    return ok;
+}
+
+// Parsing alone, then file -> cards end to end, for both formats.
+void benchmarkIngestion(GreetingCardTemplate *temp, size_t people, const std::string &path) {
+    std::cout << "\nReading " << people << " people from a file:\n";
+    std::string peoplePath = path + ".people";
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (bool binary : { false, true }) {
+        if (!writePeopleFile(peoplePath, people, binary))
+            return;
+        const char *format = binary ? "binary" : "csv";
+
+        auto start = std::chrono::steady_clock::now();
+        size_t parsed = 0, ages = 0;
+        MappedPersonSource *source = openPeopleFile(peoplePath, binary);
+        PersonBatch batch;
+        while (size_t n = source->read(batch, 4096)) {
+            parsed += n;
+            for (auto &person : batch.people)
+                ages += person.age;
+            batch.clear();
+        }
+        delete source;
+        auto middle = std::chrono::steady_clock::now();
+        ParallelCardWriter::Stats stats;
+        source = openPeopleFile(peoplePath, binary);
+        ParallelCardWriter writer(temp, cores);
+        bool written = writer.write(*source, path, &stats);
+        delete source;
+        if (!written)
+            return;
+        auto finish = std::chrono::steady_clock::now();
+
+        std::chrono::duration<double> parse = middle - start, total = finish - middle;
+        std::cout << format << " parse: " << parsed / parse.count() << " people/sec"
+                  << (parsed == people && ages > 0 ? "" : " (wrong count!)") << "\n"
+                  << format << " file -> cards: " << people / total.count() << " cards/sec, "
+                  << stats.bytes / total.count() / (1 << 20) << " MB/sec written" << std::endl;
+    }
+    std::remove(peoplePath.c_str());
+    std::remove(path.c_str());
+}
+
+void benchmarkParallelWriter(GreetingCardTemplate *temp, size_t people,
+                             const std::string &path) {
+    std::cout << "\nWriting " << people << " cards to " << path << ":\n";
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned threads : { 1u, cores }) {
+        GeneratedPersonSource source(people);
+        ParallelCardWriter writer(temp, threads);
+        ParallelCardWriter::Stats stats;
+        auto start = std::chrono::steady_clock::now();
+        if (!writer.write(source, path, &stats))
+            return;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << threads << " thread(s): " << people / elapsed.count() << " cards/sec, "
+                  << stats.bytes / elapsed.count() / (1 << 20) << " MB/sec, at most "
+                  << stats.maxReady << " batches waiting" << std::endl;
+        if (threads == cores)
+            break;
+    }
+    std::remove(path.c_str());
+}
+
+int main(int argc, char *argv[]) {
     Person *person1 = new Person("John", 39);
     Person *person2 = new Person("Ashwad", 9);
     Person *person3 = new Person("Sashwin", 10);
@@ -103,7 +655,29 @@ int main() {
     delete person1;
     delete person2;
     delete person3;
-    
+
+    std::string path;
+    if (argc > 2) {
+        path = argv[2];
+    } else {
+        char temporary[] = "/tmp/greeting-cardsXXXXXX";
+        int fd = mkstemp(temporary);
+        if (fd < 0) {
+            std::cerr << "Can't create a temporary file" << std::endl;
+            return 1;
+        }
+        close(fd);
+        path = temporary;
+    }
+    BirthdayCardTemplate birthday("Bob");
+    std::cout << "\nparallel writer matches createGreetingCards: "
+              << (checkParallelWriter(&birthday, path) ? "yes" : "NO") << std::endl;
+    std::cout << "csv and binary people files give the same cards: "
+              << (checkMappedSources(&birthday, path + ".people") ? "yes" : "NO") << std::endl;
+    size_t people = argc > 1 ? std::atol(argv[1]) : 1000000;
+    benchmarkParallelWriter(&birthday, people, path);
+    benchmarkIngestion(&birthday, people, path);
+
     return 0;
 }
 
@@ -1,8 +1,41 @@
 #include <iostream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define INTERPRETER_HAS_JIT 1
+#else
+#define INTERPRETER_HAS_JIT 0
+#endif
+
+// Machine code bytes for one expression, emitted by Expression::emit.
+// The generated code keeps the running value in eax and uses the native
+// stack for the lhs while the rhs is being computed.
+class JitCodeBuffer {
+    std::vector<uint8_t> bytes;
+public:
+    void byte(uint8_t b) { bytes.push_back(b); }
+    void imm32(int32_t value) {
+        uint8_t raw[4];
+        std::memcpy(raw, &value, sizeof(raw));
+        bytes.insert(bytes.end(), raw, raw + sizeof(raw));
+    }
+    const std::vector<uint8_t> &code() const { return bytes; }
+};
 
 class Expression {
 public:
+    virtual ~Expression() {}
     virtual int evaluate() = 0;
+    // Append native code that leaves the value in eax.
+    // Returns false when the expression can't be compiled; callers
+    // then keep using evaluate().
+    virtual bool emit(JitCodeBuffer &) { return false; }
 };
 
 class OperationExpression : public Expression {
@@ -24,6 +57,24 @@ public:
         }
         return 0;
     }
+    bool emit(JitCodeBuffer &code) override {
+        // unknown operators print a message, leave them to evaluate()
+        if (operatorSymbol != "plus" && operatorSymbol != "minus")
+            return false;
+        if (!lhs->emit(code))
+            return false;
+        code.byte(0x50);                        // push rax
+        if (!rhs->emit(code))
+            return false;
+        code.byte(0x89); code.byte(0xc1);       // mov ecx, eax
+        code.byte(0x58);                        // pop rax
+        if (operatorSymbol == "plus") {
+            code.byte(0x01); code.byte(0xc8);   // add eax, ecx
+        } else {
+            code.byte(0x29); code.byte(0xc8);   // sub eax, ecx
+        }
+        return true;
+    }
 };
 
 class NumberExpression : public Expression {
@@ -34,22 +85,191 @@ public:
     int evaluate() override {
         return std::stoi(numberString);
     }
+    bool emit(JitCodeBuffer &code) override {
+        int value;
+        try {
+            value = std::stoi(numberString);
+        } catch (const std::exception &) {
+            // let evaluate() report the bad number the usual way
+            return false;
+        }
+        code.byte(0xb8);                        // mov eax, imm32
+        code.imm32(value);
+        return true;
+    }
+};
+
+// Native code for an expression tree, living in its own executable mapping.
+// The mapping is written first and then flipped to read+execute.
+class JitFunction {
+public:
+    typedef int (*EntryPoint)();
+private:
+    void *memory = nullptr;
+    size_t size = 0;
+    EntryPoint entry = nullptr;
+public:
+    JitFunction(Expression *expression) {
+#if INTERPRETER_HAS_JIT
+        JitCodeBuffer code;
+        if (!expression->emit(code))
+            return;
+        code.byte(0xc3);                        // ret
+
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        size = (code.code().size() + pageSize - 1) / pageSize * pageSize;
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            memory = nullptr;
+            return;
+        }
+        std::memcpy(memory, code.code().data(), code.code().size());
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, size);
+            memory = nullptr;
+            return;
+        }
+        entry = reinterpret_cast<EntryPoint>(memory);
+#endif
+    }
+    ~JitFunction() {
+#if INTERPRETER_HAS_JIT
+        if (memory)
+            munmap(memory, size);
+#endif
+    }
+    JitFunction(const JitFunction &) = delete;
+    JitFunction &operator=(const JitFunction &) = delete;
+
+    bool isCompiled() const { return entry != nullptr; }
+    EntryPoint function() const { return entry; }
+};
+
+// Interprets the wrapped tree until it has been evaluated `threshold`
+// times, then switches to a JitFunction. If compilation isn't possible
+// it stays on the tree interpreter for good.
+class HotExpression : public Expression {
+    Expression *expression;
+    unsigned threshold;
+    unsigned evaluations = 0;
+    bool compileFailed = false;
+    JitFunction *jitted = nullptr;
+public:
+    HotExpression(Expression *expression, unsigned threshold = 1000) :
+        expression(expression), threshold(threshold) {}
+    ~HotExpression() {
+        delete jitted;
+    }
+    int evaluate() override {
+        if (jitted)
+            return jitted->function()();
+        if (!compileFailed && ++evaluations >= threshold) {
+            JitFunction *candidate = new JitFunction(expression);
+            if (candidate->isCompiled()) {
+                jitted = candidate;
+                return jitted->function()();
+            }
+            delete candidate;
+            compileFailed = true;
+        }
+        return expression->evaluate();
+    }
+    bool emit(JitCodeBuffer &code) override {
+        return expression->emit(code);
+    }
+    bool isJitted() const { return jitted != nullptr; }
 };
 
+// Builds a random plus/minus tree, recording every node in `nodes`
+// so the caller can free them.
+Expression *randomExpression(int depth, std::vector<Expression*> &nodes) {
+    Expression *result;
+    if (depth == 0 || std::rand() % 4 == 0) {
+        result = new NumberExpression(std::to_string(std::rand() % 2001 - 1000));
+    } else {
+        Expression *lhs = randomExpression(depth - 1, nodes);
+        Expression *rhs = randomExpression(depth - 1, nodes);
+        result = new OperationExpression(std::rand() % 2 ? "plus" : "minus", lhs, rhs);
+    }
+    nodes.push_back(result);
+    return result;
+}
+
+// Differential check: the JIT has to agree with OperationExpression::evaluate
+// on random trees. Returns the number of mismatches; `compiled` is set to
+// how many trees actually ran as native code.
+int checkJitAgainstInterpreter(int trees, int &compiled) {
+    int mismatches = 0;
+    compiled = 0;
+    std::srand(2024);
+    for (int i = 0; i < trees; ++i) {
+        std::vector<Expression*> nodes;
+        Expression *root = randomExpression(8, nodes);
+        JitFunction jit(root);
+        if (jit.isCompiled()) {
+            compiled++;
+            if (jit.function()() != root->evaluate())
+                mismatches++;
+        }
+        for (auto node : nodes) {
+            delete node;
+        }
+    }
+    return mismatches;
+}
+
+void benchmarkJit(Expression *expression, int iterations) {
+    HotExpression hot(expression, 1);
+    long long sum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        sum += expression->evaluate();
+    auto middle = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        sum -= hot.evaluate();
+    auto end = std::chrono::steady_clock::now();
+
+    std::chrono::duration<double> tree = middle - start;
+    std::chrono::duration<double> jit = end - middle;
+    std::cout << "tree interpreter: " << iterations / tree.count() << " evals/sec\n"
+              << "jit (" << (hot.isJitted() ? "native" : "fallback") << "): "
+              << iterations / jit.count() << " evals/sec"
+              << (sum == 0 ? "" : " (results differ!)") << std::endl;
+}
+
 int main (int argc, const char *argv[]) {
     NumberExpression *num1 = new NumberExpression("45");
     NumberExpression *num2 = new NumberExpression("37");
     OperationExpression *exp1 = new OperationExpression("plus", num1, num2);
     std::cout << "45 + 37: " << exp1->evaluate() << std::endl;
-    
+
     NumberExpression *num3 = new NumberExpression("63");
     OperationExpression *exp2 = new OperationExpression("minus", num3, exp1);
     std::cout << "63 - (45 + 37) : " << exp2->evaluate() << std::endl;
-    
+
+    HotExpression *hot = new HotExpression(exp2, 3);
+    for (int i = 0; i < 3; ++i)
+        hot->evaluate();
+    std::cout << "63 - (45 + 37) jitted: " << hot->evaluate()
+              << (hot->isJitted() ? "" : " (interpreted)") << std::endl;
+
+    int compiled;
+    int mismatches = checkJitAgainstInterpreter(1000, compiled);
+    std::cout << "jit mismatches on random trees: " << mismatches
+              << " (" << compiled << " of 1000 compiled)" << std::endl;
+    if (compiled == 0)
+        std::cout << "jit unavailable: nothing was compiled, only the interpreter was checked" << std::endl;
+
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    benchmarkJit(exp2, iterations);
+
+    delete hot;
     delete num1;
     delete num2;
     delete num3;
     delete exp1;
     delete exp2;
-    return 0;
+    return mismatches == 0 ? 0 : 1;
 }
@@ -36,12 +36,36 @@
 
 #include<iostream>
 #include<vector>
+#include<algorithm>
+#include<chrono>
+#include<cstdlib>
+#include<queue>
+#include<deque>
+#include<functional>
+#include<mutex>
+#include<thread>
+#include<atomic>
+#include<cstdio>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
 
 class NumbersIterator {
 public:
     virtual ~NumbersIterator() {}
     virtual int next() = 0;
     virtual bool isFinished() = 0;
+    // Copies up to `capacity` elements into `out` and returns how many were
+    // written; 0 means the iterator is finished. One virtual call per batch
+    // instead of two per element.
+    virtual size_t nextBatch(int *out, size_t capacity) {
+        size_t count = 0;
+        while (count < capacity && !isFinished()) {
+            out[count++] = next();
+        }
+        return count;
+    }
 };
 
 class ForwardIterator : public NumbersIterator {
@@ -59,6 +83,12 @@ public:
     bool isFinished() {
         return currentPosition >= numbers.size();
     }
+    size_t nextBatch(int *out, size_t capacity) override {
+        size_t count = std::min(capacity, numbers.size() - currentPosition);
+        std::copy_n(numbers.data() + currentPosition, count, out);
+        currentPosition += count;
+        return count;
+    }
 };
 
 class BackwardIterator : public NumbersIterator {
@@ -76,23 +106,628 @@ public:
     bool isFinished() {
         return currentPosition >= numbers.size();
     }
+    size_t nextBatch(int *out, size_t capacity) override {
+        size_t count = std::min(capacity, numbers.size() - currentPosition);
+        const int *src = numbers.data() + numbers.size() - currentPosition;
+        std::reverse_copy(src - count, src, out);
+        currentPosition += count;
+        return count;
+    }
+};
+
+// Forward iterator over a contiguous range that can hand off part of its
+// remaining elements to another iterator, so the pieces can be consumed
+// on different threads (like Java's Spliterator).
+class NumbersSpliterator : public NumbersIterator {
+    const int *current;
+    const int *end;
+public:
+    // ranges smaller than this aren't worth splitting further
+    static const size_t minimumSplitSize = 16384;
+
+    NumbersSpliterator(const int *begin, const int *end) :
+        current(begin), end(end) {}
+
+    int next() override {
+        return *current++;
+    }
+    bool isFinished() override {
+        return current >= end;
+    }
+    size_t nextBatch(int *out, size_t capacity) override {
+        size_t count = std::min<size_t>(capacity, end - current);
+        std::copy_n(current, count, out);
+        current += count;
+        return count;
+    }
+    size_t remaining() const {
+        return end - current;
+    }
+    // Gives the upper half of the remaining elements to a new iterator and
+    // keeps the lower half. Returns nullptr when the range is too small.
+    NumbersSpliterator *trySplit() {
+        if (remaining() < 2 * minimumSplitSize)
+            return nullptr;
+        const int *middle = current + remaining() / 2;
+        NumbersSpliterator *upper = new NumbersSpliterator(middle, end);
+        end = middle;
+        return upper;
+    }
 };
 
 class NumberCollection {
     std::vector<int> numbers;
 public:
-    NumberCollection(const std::vector<int> &numbers) : numbers(numbers) {}
+    // pass an rvalue to hand over the vector without copying it
+    NumberCollection(std::vector<int> numbers) : numbers(std::move(numbers)) {}
     NumbersIterator *getForwardIterator() {
         return new ForwardIterator(numbers);
     }
     NumbersIterator *getBackwardIterator() {
         return new BackwardIterator(numbers);
     }
+    NumbersSpliterator *getSpliterator() {
+        return new NumbersSpliterator(numbers.data(), numbers.data() + numbers.size());
+    }
+};
+
+// Walks a range from the back. Used for memory that isn't a std::vector,
+// e.g. the mapped file below; prefetches the next window behind the cursor
+// since the kernel's readahead only works forwards.
+class BackwardRangeIterator : public NumbersIterator {
+    const int *begin;
+    const int *current;
+    const int *prefetched;
+    bool prefetch;
+    static const size_t prefetchWindow = 1 << 20;  // elements
+
+    void prefetchAhead() {
+        if (!prefetch || current - begin <= 0 || current > prefetched)
+            return;
+        const int *from = static_cast<size_t>(current - begin) > prefetchWindow
+                          ? current - prefetchWindow : begin;
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        uintptr_t start = reinterpret_cast<uintptr_t>(from) / pageSize * pageSize;
+        madvise(reinterpret_cast<void*>(start),
+                reinterpret_cast<uintptr_t>(current) - start, MADV_WILLNEED);
+        prefetched = from;
+    }
+public:
+    BackwardRangeIterator(const int *begin, const int *end, bool prefetch) :
+        begin(begin), current(end), prefetched(end), prefetch(prefetch) {
+        prefetchAhead();
+    }
+    int next() override {
+        int value = *--current;
+        if (current == prefetched)
+            prefetchAhead();
+        return value;
+    }
+    bool isFinished() override {
+        return current <= begin;
+    }
+    size_t nextBatch(int *out, size_t capacity) override {
+        size_t count = std::min<size_t>(capacity, current - begin);
+        std::reverse_copy(current - count, current, out);
+        bool crossed = current - count <= prefetched;
+        current -= count;
+        if (crossed)
+            prefetchAhead();
+        return count;
+    }
+};
+
+// The forward counterpart: asks for the next window of pages as it
+// reaches the end of the previous one. The advice only covers the pages
+// this iterator is about to read, so it doesn't disturb other iterators
+// over the same mapping.
+class ForwardRangeIterator : public NumbersIterator {
+    const int *current;
+    const int *end;
+    const int *prefetched;
+    bool prefetch;
+    static const size_t prefetchWindow = 1 << 20;  // elements
+
+    void prefetchAhead() {
+        if (!prefetch || end - current <= 0 || current < prefetched)
+            return;
+        const int *to = static_cast<size_t>(end - current) > prefetchWindow
+                        ? current + prefetchWindow : end;
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        uintptr_t start = reinterpret_cast<uintptr_t>(current) / pageSize * pageSize;
+        madvise(reinterpret_cast<void*>(start),
+                reinterpret_cast<uintptr_t>(to) - start, MADV_WILLNEED);
+        prefetched = to;
+    }
+public:
+    ForwardRangeIterator(const int *begin, const int *end, bool prefetch) :
+        current(begin), end(end), prefetched(begin), prefetch(prefetch) {
+        prefetchAhead();
+    }
+    int next() override {
+        int value = *current++;
+        if (current == prefetched)
+            prefetchAhead();
+        return value;
+    }
+    bool isFinished() override {
+        return current >= end;
+    }
+    size_t nextBatch(int *out, size_t capacity) override {
+        size_t count = std::min<size_t>(capacity, end - current);
+        std::copy_n(current, count, out);
+        current += count;
+        if (current >= prefetched)
+            prefetchAhead();
+        return count;
+    }
+};
+
+// Same iterators as NumberCollection, backed by a file of native-endian
+// ints mapped into memory. Opening costs the same whatever the file size;
+// pages are only read as the iterators reach them.
+class MappedNumberCollection {
+    void *mapping = nullptr;
+    size_t mappedBytes = 0;
+    const int *numbers = nullptr;
+    size_t count = 0;
+public:
+    MappedNumberCollection(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Can't open " << path << "\n";
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            mappedBytes = info.st_size;
+            mapping = mmap(nullptr, mappedBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                std::cerr << "Can't map " << path << "\n";
+                mapping = nullptr;
+                mappedBytes = 0;
+            } else {
+                numbers = static_cast<const int*>(mapping);
+                count = mappedBytes / sizeof(int);
+            }
+        }
+        close(fd);
+    }
+    ~MappedNumberCollection() {
+        if (mapping)
+            munmap(mapping, mappedBytes);
+    }
+    MappedNumberCollection(const MappedNumberCollection &) = delete;
+    MappedNumberCollection &operator=(const MappedNumberCollection &) = delete;
+
+    size_t size() const {
+        return count;
+    }
+    // Each iterator prefetches only the window it is about to read, so
+    // forward and backward iterators can be used side by side.
+    NumbersIterator *getForwardIterator() {
+        return new ForwardRangeIterator(numbers, numbers + count, mapping != nullptr);
+    }
+    NumbersIterator *getBackwardIterator() {
+        return new BackwardRangeIterator(numbers, numbers + count, mapping != nullptr);
+    }
+    NumbersSpliterator *getSpliterator() {
+        return new NumbersSpliterator(numbers, numbers + count);
+    }
+};
+
+// Runs a task and everything it spawns on a fixed set of threads. Each
+// worker pops its own newest task first and steals the oldest task of
+// another worker when it runs dry, so large pieces of work get stolen
+// while small ones stay local.
+class WorkStealingPool {
+public:
+    typedef std::function<void(unsigned worker)> Task;
+private:
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+    std::vector<WorkQueue> queues;
+    std::atomic<size_t> pending;
+
+    bool popLocal(unsigned worker, Task &task) {
+        std::lock_guard<std::mutex> guard(queues[worker].lock);
+        if (queues[worker].tasks.empty())
+            return false;
+        task = std::move(queues[worker].tasks.back());
+        queues[worker].tasks.pop_back();
+        return true;
+    }
+    bool steal(unsigned worker, Task &task) {
+        for (size_t i = 1; i < queues.size(); ++i) {
+            WorkQueue &victim = queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+    void work(unsigned worker) {
+        Task task;
+        while (pending.load() > 0) {
+            if (popLocal(worker, task) || steal(worker, task)) {
+                task(worker);
+                pending--;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+public:
+    WorkStealingPool(unsigned threads) : queues(threads > 0 ? threads : 1), pending(0) {}
+
+    unsigned size() const {
+        return queues.size();
+    }
+    // Called from inside a running task to queue more work on `worker`.
+    void spawn(unsigned worker, Task task) {
+        pending++;
+        std::lock_guard<std::mutex> guard(queues[worker].lock);
+        queues[worker].tasks.push_back(std::move(task));
+    }
+    // Blocks until `root` and all the tasks it spawned have finished.
+    void run(Task root) {
+        spawn(0, std::move(root));
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < queues.size(); ++i) {
+            threads.emplace_back(&WorkStealingPool::work, this, i);
+        }
+        work(0);
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+};
+
+// Splits `it` until it is small, spawning the split-off halves, then feeds
+// what is left to `consume(worker, batch, count)`. Takes ownership of `it`.
+template<typename Consume>
+void splitAndConsume(WorkStealingPool &pool, unsigned worker,
+                     NumbersSpliterator *it, Consume &consume) {
+    while (NumbersSpliterator *upper = it->trySplit()) {
+        pool.spawn(worker, [&pool, upper, &consume](unsigned w) {
+            splitAndConsume(pool, w, upper, consume);
+        });
+    }
+    int batch[1024];
+    while (size_t count = it->nextBatch(batch, 1024)) {
+        consume(worker, batch, count);
+    }
+    delete it;
+}
+
+// Calls f(value) for every element; calls happen concurrently and in no
+// particular order.
+template<typename F>
+void parallelForEach(NumberCollection &collection, F f, WorkStealingPool &pool) {
+    auto consume = [&f](unsigned, const int *batch, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            f(batch[i]);
+        }
+    };
+    pool.run([&pool, &collection, &consume](unsigned w) {
+        splitAndConsume(pool, w, collection.getSpliterator(), consume);
+    });
+}
+
+// Folds every element into `identity` with accumulate(T, int), then merges
+// the per-worker results with combine(T, T). Elements are visited in no
+// particular order, so both must be associative and commutative.
+template<typename T, typename Accumulate, typename Combine>
+T parallelReduce(NumberCollection &collection, T identity, Accumulate accumulate,
+                 Combine combine, WorkStealingPool &pool) {
+    // one accumulator per worker, padded so workers don't share cache lines
+    struct alignas(64) Partial { T value; };
+    std::vector<Partial> partials(pool.size(), Partial{ identity });
+    auto consume = [&partials, &accumulate](unsigned worker, const int *batch, size_t count) {
+        T acc = partials[worker].value;
+        for (size_t i = 0; i < count; ++i) {
+            acc = accumulate(acc, batch[i]);
+        }
+        partials[worker].value = acc;
+    };
+    pool.run([&pool, &collection, &consume](unsigned w) {
+        splitAndConsume(pool, w, collection.getSpliterator(), consume);
+    });
+    T result = identity;
+    for (auto &partial : partials) {
+        result = combine(result, partial.value);
+    }
+    return result;
+}
+
+// Tree stored as flat value arrays, one per traversal order, built once
+// up front. Traversal is then a linear scan: no pointer chasing, no
+// per-iterator stack or queue.
+class TreeCollection {
+    std::vector<int> preorder;
+    std::vector<int> levelOrder;
+public:
+    // parents[i] is the index of node i's parent, -1 for the root (node 0).
+    // Children keep the order in which they appear in `values`. Input that
+    // isn't a single tree rooted at node 0 is reported and leaves the
+    // collection empty.
+    TreeCollection(const std::vector<int> &values, const std::vector<int> &parents) {
+        size_t count = values.size();
+        if (parents.size() != count) {
+            std::cerr << "TreeCollection: " << count << " values but "
+                      << parents.size() << " parents\n";
+            return;
+        }
+        if (count > 0 && parents[0] != -1) {
+            std::cerr << "TreeCollection: node 0 must be the root\n";
+            return;
+        }
+        for (size_t i = 1; i < count; ++i) {
+            if (parents[i] < 0 || static_cast<size_t>(parents[i]) >= count ||
+                static_cast<size_t>(parents[i]) == i) {
+                std::cerr << "TreeCollection: bad parent " << parents[i]
+                          << " for node " << i << "\n";
+                return;
+            }
+        }
+        // children of node i are childList[firstChild[i] .. firstChild[i + 1])
+        std::vector<int> firstChild(count + 1, 0);
+        for (size_t i = 1; i < count; ++i) {
+            firstChild[parents[i] + 1]++;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            firstChild[i + 1] += firstChild[i];
+        }
+        std::vector<int> childList(count > 0 ? count - 1 : 0);
+        std::vector<int> fill(firstChild.begin(), firstChild.end() - 1);
+        for (size_t i = 1; i < count; ++i) {
+            childList[fill[parents[i]]++] = i;
+        }
+        if (count == 0)
+            return;
+
+        preorder.reserve(count);
+        std::vector<int> pending = { 0 };
+        while (!pending.empty()) {
+            int node = pending.back();
+            pending.pop_back();
+            preorder.push_back(values[node]);
+            for (int c = firstChild[node + 1] - 1; c >= firstChild[node]; --c) {
+                pending.push_back(childList[c]);
+            }
+        }
+
+        // level order is just a scan over the growing node list
+        std::vector<int> queue = { 0 };
+        queue.reserve(count);
+        levelOrder.reserve(count);
+        for (size_t head = 0; head < queue.size(); ++head) {
+            int node = queue[head];
+            levelOrder.push_back(values[node]);
+            queue.insert(queue.end(), childList.begin() + firstChild[node],
+                         childList.begin() + firstChild[node + 1]);
+        }
+
+        // nodes on a parent cycle are never reached from the root
+        if (preorder.size() != count) {
+            std::cerr << "TreeCollection: " << count - preorder.size()
+                      << " nodes aren't connected to the root\n";
+            preorder.clear();
+            levelOrder.clear();
+        }
+    }
+    size_t size() const {
+        return preorder.size();
+    }
+    NumbersIterator *getDepthFirstIterator();
+    NumbersIterator *getBreadthFirstIterator();
+};
+
+class DepthFirstTreeIterator : public ForwardIterator {
+public:
+    DepthFirstTreeIterator(std::vector<int> &preorder) : ForwardIterator(preorder) {}
+};
+
+class BreadthFirstTreeIterator : public ForwardIterator {
+public:
+    BreadthFirstTreeIterator(std::vector<int> &levelOrder) : ForwardIterator(levelOrder) {}
+};
+
+NumbersIterator *TreeCollection::getDepthFirstIterator() {
+    return new DepthFirstTreeIterator(preorder);
+}
+NumbersIterator *TreeCollection::getBreadthFirstIterator() {
+    return new BreadthFirstTreeIterator(levelOrder);
+}
+
+// The naive layout the flat TreeCollection is compared against.
+struct PointerTreeNode {
+    int value;
+    std::vector<PointerTreeNode*> children;
 };
 
-int main() {
+// elements/sec for the per-element next() loop versus nextBatch()
+void benchmarkIteration(NumberCollection &collection, size_t size) {
+    const size_t batchSize = 4096;
+    std::vector<int> batch(batchSize);
+    long long elementSum = 0, batchSum = 0;
+
+    NumbersIterator *it = collection.getForwardIterator();
+    auto start = std::chrono::steady_clock::now();
+    while (!it->isFinished()) {
+        elementSum += it->next();
+    }
+    auto middle = std::chrono::steady_clock::now();
+    delete it;
+
+    it = collection.getForwardIterator();
+    auto batchStart = std::chrono::steady_clock::now();
+    while (size_t count = it->nextBatch(batch.data(), batchSize)) {
+        for (size_t i = 0; i < count; ++i) {
+            batchSum += batch[i];
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    delete it;
+
+    std::chrono::duration<double> perElement = middle - start;
+    std::chrono::duration<double> batched = end - batchStart;
+    std::cout << "next():      " << size / perElement.count() << " elements/sec\n"
+              << "nextBatch(): " << size / batched.count() << " elements/sec"
+              << (elementSum == batchSum ? "" : " (sums differ!)") << "\n\n";
+}
+
+// true if both iterators yield exactly the same sequence; deletes both
+bool sameSequence(NumbersIterator *a, NumbersIterator *b) {
+    bool same = true;
+    while (same && !a->isFinished() && !b->isFinished()) {
+        same = a->next() == b->next();
+    }
+    same = same && a->isFinished() && b->isFinished();
+    delete a;
+    delete b;
+    return same;
+}
+
+// Writes the collection to a temporary file a batch at a time, maps it
+// back and checks that both backends iterate identically.
+void checkMappedCollection(NumberCollection &collection) {
+    char path[] = "/tmp/numbersXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        std::cerr << "Can't create a temporary file\n";
+        return;
+    }
+    bool written = true;
+    std::vector<int> batch(4096);
+    NumbersIterator *it = collection.getForwardIterator();
+    while (size_t n = it->nextBatch(batch.data(), batch.size())) {
+        size_t bytes = n * sizeof(int);
+        written = written && write(fd, batch.data(), bytes) == static_cast<ssize_t>(bytes);
+    }
+    delete it;
+    close(fd);
+
+    auto start = std::chrono::steady_clock::now();
+    MappedNumberCollection mapped(path);
+    std::chrono::duration<double, std::micro> opening = std::chrono::steady_clock::now() - start;
+
+    bool forward = sameSequence(collection.getForwardIterator(), mapped.getForwardIterator());
+    bool backward = sameSequence(collection.getBackwardIterator(), mapped.getBackwardIterator());
+    std::cout << "mapped " << mapped.size() << " ints in " << opening.count() << " us, "
+              << "forward " << (written && forward ? "matches" : "DIFFERS") << ", "
+              << "backward " << (written && backward ? "matches" : "DIFFERS") << "\n\n";
+    unlink(path);
+}
+
+// parallelReduce throughput from one thread up to every hardware thread
+void benchmarkParallelReduce(NumberCollection &collection, size_t size) {
+    unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> threadCounts;
+    for (unsigned threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    auto sumSquares = [](long long acc, long long value) { return acc + value * value; };
+    auto add = [](long long a, long long b) { return a + b; };
+    double oneThread = 0;
+    std::cout << "parallelReduce over " << size << " elements:\n";
+    for (unsigned threads : threadCounts) {
+        WorkStealingPool pool(threads);
+        auto start = std::chrono::steady_clock::now();
+        long long result = parallelReduce(collection, 0LL, sumSquares, add, pool);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (threads == 1)
+            oneThread = elapsed.count();
+        std::cout << threads << " threads: " << size / elapsed.count() << " elements/sec, "
+                  << "speedup " << oneThread / elapsed.count()
+                  << " (result " << result << ")\n";
+    }
+    std::cout << "\n";
+}
+
+// time to sum every node of a random tree: flat iterators vs pointer nodes
+void benchmarkTreeTraversal(size_t size) {
+    if (size == 0) {
+        std::cerr << "Tree benchmark needs at least one node\n";
+        return;
+    }
+    std::vector<int> values(size), parents(size, -1);
+    std::vector<PointerTreeNode*> nodes(size);
+    std::srand(42);
+    for (size_t i = 0; i < size; ++i) {
+        values[i] = std::rand() % 1000;
+        nodes[i] = new PointerTreeNode{ values[i], {} };
+        if (i > 0) {
+            parents[i] = std::rand() % i;
+            nodes[parents[i]]->children.push_back(nodes[i]);
+        }
+    }
+    auto build = std::chrono::steady_clock::now();
+    TreeCollection tree(values, parents);
+    long long flatDfs = 0, flatBfs = 0, pointerDfs = 0, pointerBfs = 0;
+
+    auto t0 = std::chrono::steady_clock::now();
+    NumbersIterator *dfs = tree.getDepthFirstIterator();
+    while (!dfs->isFinished()) {
+        flatDfs += dfs->next();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    NumbersIterator *bfs = tree.getBreadthFirstIterator();
+    while (!bfs->isFinished()) {
+        flatBfs += bfs->next();
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    std::vector<PointerTreeNode*> stack = { nodes[0] };
+    while (!stack.empty()) {
+        PointerTreeNode *node = stack.back();
+        stack.pop_back();
+        pointerDfs += node->value;
+        stack.insert(stack.end(), node->children.rbegin(), node->children.rend());
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    std::queue<PointerTreeNode*> queue;
+    queue.push(nodes[0]);
+    while (!queue.empty()) {
+        PointerTreeNode *node = queue.front();
+        queue.pop();
+        pointerBfs += node->value;
+        for (auto child : node->children) {
+            queue.push(child);
+        }
+    }
+    auto t4 = std::chrono::steady_clock::now();
+
+    auto ms = [](std::chrono::steady_clock::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+    // the flat layout pays for its traversal orders up front
+    std::cout << "Traversing a " << size << "-node tree:\n"
+              << "flat build (both orders): " << ms(t0 - build) << " ms\n"
+              << "flat depth-first:      " << ms(t1 - t0) << " ms"
+              << " (" << ms(t1 - build) << " ms with its build)\n"
+              << "flat breadth-first:    " << ms(t2 - t1) << " ms\n"
+              << "pointer depth-first:   " << ms(t3 - t2) << " ms\n"
+              << "pointer breadth-first: " << ms(t4 - t3) << " ms"
+              << (flatDfs == pointerDfs && flatBfs == pointerBfs ? "" : " (sums differ!)")
+              << "\n\n";
+
+    delete dfs;
+    delete bfs;
+    for (auto node : nodes) {
+        delete node;
+    }
+}
+
+int main(int argc, char *argv[]) {
     std::vector<int> numbers = { 1, 1, 2, 3, 5, 8, 13, 21, 34 };
-    NumberCollection fibNums(numbers);
+    NumberCollection fibNums(std::move(numbers));
     
     NumbersIterator *fi = fibNums.getForwardIterator();
     std::cout << "Iterating forward:\n";
@@ -107,6 +742,68 @@ int main() {
         std::cout << bi->next() << " ";
     }
     std::cout << "\n\n";
+
+    NumbersIterator *bbi = fibNums.getBackwardIterator();
+    int batch[4];
+    std::cout << "Iterating backward in batches of 4:\n";
+    while (size_t count = bbi->nextBatch(batch, 4)) {
+        for (size_t i = 0; i < count; ++i) {
+            std::cout << batch[i] << " ";
+        }
+        std::cout << "| ";
+    }
+    std::cout << "\n\n";
+
+    size_t size = argc > 1 ? std::atol(argv[1]) : 10000000;
+    std::vector<int> many(size);
+    for (size_t i = 0; i < size; ++i) {
+        many[i] = i % 1000;
+    }
+    NumberCollection manyNums(std::move(many));
+    benchmarkIteration(manyNums, size);
+    checkMappedCollection(manyNums);
+
+    WorkStealingPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    std::atomic<long long> evenCount(0);
+    parallelForEach(manyNums, [&evenCount](int value) {
+        if (value % 2 == 0)
+            evenCount++;
+    }, pool);
+    std::cout << "parallelForEach counted " << evenCount << " even elements\n";
+    benchmarkParallelReduce(manyNums, size);
+
+    /*        1
+            / | \
+           2  3  4
+          / \     \
+         5   6     7
+    */
+    TreeCollection tree({ 1, 2, 3, 4, 5, 6, 7 }, { -1, 0, 0, 0, 1, 1, 3 });
+    NumbersIterator *dfs = tree.getDepthFirstIterator();
+    std::cout << "Tree depth first:\n";
+    while (!dfs->isFinished()) {
+        std::cout << dfs->next() << " ";
+    }
+    std::cout << "\n\n";
+    NumbersIterator *bfs = tree.getBreadthFirstIterator();
+    std::cout << "Tree breadth first:\n";
+    while (!bfs->isFinished()) {
+        std::cout << bfs->next() << " ";
+    }
+    std::cout << "\n\n";
+
+    // 2 and 3 are each other's parent, so they never reach the root
+    TreeCollection broken({ 1, 2, 3 }, { -1, 2, 1 });
+    std::cout << "Broken tree kept " << broken.size() << " nodes\n\n";
+
+    size_t treeSize = argc > 2 ? std::atol(argv[2]) : 1000000;
+    benchmarkTreeTraversal(treeSize);
+
+    delete fi;
+    delete bi;
+    delete bbi;
+    delete dfs;
+    delete bfs;
     return 0;
 }
 
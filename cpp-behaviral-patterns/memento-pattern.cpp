@@ -38,18 +38,106 @@
 */
 #include<iostream>
 #include<vector>
+#include<memory>
+#include<chrono>
+#include<cstdlib>
+#include<cstdint>
+#include<deque>
+#include<string>
+#include<unordered_map>
+
+typedef uint32_t ShapeId;
+
+// Every distinct shape name is stored once; canvases and their history
+// carry the small id instead and only look the name up for output.
+// Not synchronized: intern from the editing thread only.
+class ShapeNames {
+    static std::deque<std::string> &names() {
+        static std::deque<std::string> names;  // deque keeps references stable
+        return names;
+    }
+    static std::unordered_map<std::string, ShapeId> &ids() {
+        static std::unordered_map<std::string, ShapeId> ids;
+        return ids;
+    }
+public:
+    static ShapeId intern(const std::string &name) {
+        auto found = ids().find(name);
+        if (found != ids().end())
+            return found->second;
+        ShapeId id = names().size();
+        names().push_back(name);
+        ids().emplace(name, id);
+        return id;
+    }
+    static const std::string &name(ShapeId id) {
+        return names()[id];
+    }
+};
+
+// Shapes in insertion order, kept as an immutable list that grows at the
+// back. Copies share all their nodes, so a snapshot is a pointer copy and
+// undo just swaps back to an older list.
+class ShapeList {
+    struct Node {
+        ShapeId shape;
+        mutable std::shared_ptr<const Node> previous;
+        size_t size;
+        Node(ShapeId shape, std::shared_ptr<const Node> previous) :
+            shape(shape), previous(previous), size(previous ? previous->size + 1 : 1) {}
+        ~Node() {
+            // unlink iteratively, a long list would overflow the stack otherwise
+            std::shared_ptr<const Node> next = std::move(previous);
+            while (next && next.use_count() == 1) {
+                next = std::move(next->previous);
+            }
+        }
+    };
+    std::shared_ptr<const Node> last;
+public:
+    void push_back(ShapeId shape) {
+        last = std::make_shared<const Node>(shape, last);
+    }
+    void clear() {
+        last.reset();
+    }
+    size_t size() const {
+        return last ? last->size : 0;
+    }
+    std::vector<ShapeId> ids() const {
+        std::vector<ShapeId> shapes(size());
+        size_t i = shapes.size();
+        for (const Node *node = last.get(); node; node = node->previous.get()) {
+            shapes[--i] = node->shape;
+        }
+        return shapes;
+    }
+    std::vector<std::string> toVector() const {
+        std::vector<std::string> shapes;
+        shapes.reserve(size());
+        for (ShapeId id : ids()) {
+            shapes.push_back(ShapeNames::name(id));
+        }
+        return shapes;
+    }
+    // bytes held by a list of `nodes` nodes that shares nothing
+    static size_t bytesFor(size_t nodes) {
+        // make_shared puts the control block (two counts and a vtable) next to the node
+        return nodes * (sizeof(Node) + 2 * sizeof(long) + sizeof(void*));
+    }
+};
 
 class Canvas;
 
 class CanvasMemento {
     friend class Canvas;
-    const std::vector<std::string> shapes;
+    const ShapeList shapes;
 public:
-    CanvasMemento(std::vector<std::string> shapes) : shapes(shapes) {}
+    CanvasMemento(const ShapeList &shapes) : shapes(shapes) {}
 };
 
 class Canvas {
-    std::vector<std::string> shapes;
+    ShapeList shapes;
     std::vector<CanvasMemento*> oldStates;
 public:
     ~Canvas() {
@@ -59,13 +147,13 @@ public:
     }
     void addShape(const std::string &newShape) {
         oldStates.push_back(new CanvasMemento(shapes));
-        shapes.push_back(newShape);
+        shapes.push_back(ShapeNames::intern(newShape));
     }
     void clearAll() {
         shapes.clear();
     }
     std::vector<std::string> getShapes() {
-        return shapes;
+        return shapes.toVector();
     }
     void undo() {
         CanvasMemento *previousState = oldStates.back();
@@ -75,8 +163,54 @@ public:
     }
 };
 
+// The previous design: every memento owns a full copy of the shapes.
+class CopyingCanvas {
+    std::vector<std::string> shapes;
+    std::vector<std::vector<std::string>> oldStates;
+public:
+    void addShape(const std::string &newShape) {
+        oldStates.push_back(shapes);
+        shapes.push_back(newShape);
+    }
+    size_t bytesHeld() const {
+        size_t bytes = 0;
+        for (auto &state : oldStates) {
+            bytes += sizeof(state) + state.capacity() * sizeof(std::string);
+        }
+        return bytes;
+    }
+};
+
+// Time and memento memory for `edits` calls to addShape. The copying
+// canvas is quadratic, so it only gets a fraction of the edits.
+void benchmarkEdits(size_t edits) {
+    size_t copyingEdits = std::min<size_t>(edits, 3000);
+    auto start = std::chrono::steady_clock::now();
+    CopyingCanvas *copying = new CopyingCanvas;
+    for (size_t i = 0; i < copyingEdits; ++i) {
+        copying->addShape("square");
+    }
+    std::chrono::duration<double> copyingTime = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    Canvas *canvas = new Canvas;
+    for (size_t i = 0; i < edits; ++i) {
+        canvas->addShape("square");
+    }
+    std::chrono::duration<double> sharingTime = std::chrono::steady_clock::now() - start;
 
-int main() {
+    std::cout << "copying mementos, " << copyingEdits << " edits: "
+              << copyingTime.count() << " s, "
+              << copying->bytesHeld() / (1024 * 1024) << " MiB\n"
+              << "shared mementos,  " << edits << " edits: "
+              << sharingTime.count() << " s, "
+              << (ShapeList::bytesFor(edits) + edits * sizeof(CanvasMemento)) / (1024 * 1024)
+              << " MiB\n";
+    delete copying;
+    delete canvas;
+}
+
+int main(int argc, char *argv[]) {
     Canvas *canvas = new Canvas;
     
     canvas->addShape("rhombus");
@@ -112,6 +246,8 @@ int main() {
  
     delete canvas;
 
+    benchmarkEdits(argc > 1 ? std::atol(argv[1]) : 1000000);
+
     return 0;
 }
 
@@ -9,6 +9,26 @@
 */
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <type_traits>
+#include <tuple>
+#include <sstream>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
 
 class Logger {
 public:
@@ -42,34 +62,1011 @@ public:
     void log(const std::string &msg) {}
 };
 
-class SomeTask {
-    Logger *logger = nullptr;
- public:
-    SomeTask() { logger = new NullLogger; }
-    SomeTask(Logger *logger) : logger(logger) {}
-    ~SomeTask() { delete logger; }
-    void execute() {
-        if (logger) {
-            logger->log("Did some stuff");
+// Logs from any number of threads without taking a lock or making a system
+// call on the calling thread. Each thread copies its messages into its
+// own single-producer ring buffer; a background thread drains all the
+// rings every `drainInterval` and writes what it found to the file (or
+// stdout) in one write() per batch. Messages from one thread stay in
+// order; messages from different threads are only ordered per drain.
+//
+// Every AsyncLogger starts its own drainer thread, so share one logger
+// between tasks rather than creating one per task. Messages longer than
+// maxMessageSize() are cut to that length and counted by truncated().
+class AsyncLogger : public Logger {
+public:
+    enum OverflowPolicy {
+        DropNewest,     // a full ring drops the message and counts it
+        Block           // the caller waits for the drainer to make room
+    };
+    // Threads past this many at once share one ring behind a mutex.
+    static constexpr unsigned maxThreadSlots = 256;
+private:
+    // Records are a 4-byte length and the message, padded to 8 bytes. A
+    // record never wraps: the space left at the end is skipped with a
+    // wrapMarker instead.
+    struct Ring {
+        static constexpr uint32_t wrapMarker = UINT32_MAX;
+        std::unique_ptr<char[]> data;
+        size_t capacity;
+        alignas(64) std::atomic<uint64_t> head{0};     // written by the producer
+        uint64_t cachedTail = 0;                        // producer's view of tail
+        alignas(64) std::atomic<uint64_t> tail{0};     // written by the drainer
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> truncated{0};
+
+        Ring(size_t capacity) : data(new char[capacity]), capacity(capacity) {}
+    };
+
+    // A small number per live thread, handed back when the thread exits so
+    // that slots, and the rings loggers keep for them, are reused.
+    class ThreadSlot {
+        static std::mutex &mutex() {
+            static std::mutex slotMutex;
+            return slotMutex;
         }
-        // code
+        static std::vector<unsigned> &freeSlots() {
+            static std::vector<unsigned> slots;
+            return slots;
+        }
+        static unsigned &nextSlot() {
+            static unsigned next = 0;
+            return next;
+        }
+    public:
+        const unsigned slot;
+        ThreadSlot() : slot(take()) {}
+        ~ThreadSlot() {
+            std::lock_guard<std::mutex> lock(mutex());
+            freeSlots().push_back(slot);
+        }
+        static unsigned take() {
+            std::lock_guard<std::mutex> lock(mutex());
+            if (freeSlots().empty())
+                return nextSlot()++;
+            unsigned slot = freeSlots().back();
+            freeSlots().pop_back();
+            return slot;
+        }
+    };
+
+    std::string prefix;
+    OverflowPolicy policy;
+    size_t ringBytes;
+    std::chrono::microseconds drainInterval;
+    int fd;
+    bool ownsFd;
+
+    std::mutex mutex;               // guards rings and the drain handshake
+    std::condition_variable changed;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::unique_ptr<std::atomic<Ring*>[]> ringsBySlot;     // maxThreadSlots entries
+    Ring *sharedRing = nullptr;     // for threads without a slot
+    std::mutex sharedMutex;         // one producer at a time on sharedRing
+    uint64_t drainRequests = 0;
+    uint64_t drainsDone = 0;
+    bool stopping = false;
+    std::thread drainer;
+    std::string batch;
+
+    static size_t recordSize(size_t length) {
+        return (sizeof(uint32_t) + length + 7) & ~size_t(7);
+    }
+
+    Ring *newRing() {
+        std::lock_guard<std::mutex> lock(mutex);
+        rings.emplace_back(new Ring(ringBytes));
+        return rings.back().get();
+    }
+    // nullptr if this thread has no slot
+    Ring *ringForThisThread() {
+        static thread_local ThreadSlot thread;
+        if (thread.slot >= maxThreadSlots)
+            return nullptr;
+        Ring *ring = ringsBySlot[thread.slot].load(std::memory_order_acquire);
+        if (!ring) {
+            ring = newRing();
+            ringsBySlot[thread.slot].store(ring, std::memory_order_release);
+        }
+        return ring;
+    }
+
+    bool push(Ring &ring, const char *msg, size_t length) {
+        if (length > maxMessageSize()) {
+            length = maxMessageSize();
+            ring.truncated.fetch_add(1, std::memory_order_relaxed);
+        }
+        size_t need = recordSize(length);
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        size_t offset = head & (ring.capacity - 1);
+        size_t skip = offset + need > ring.capacity ? ring.capacity - offset : 0;
+        while (head + skip + need - ring.cachedTail > ring.capacity) {
+            ring.cachedTail = ring.tail.load(std::memory_order_acquire);
+            if (head + skip + need - ring.cachedTail <= ring.capacity)
+                break;
+            if (policy == DropNewest) {
+                ring.dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        if (skip) {
+            uint32_t marker = Ring::wrapMarker;
+            std::memcpy(ring.data.get() + offset, &marker, sizeof(marker));
+            offset = 0;
+        }
+        uint32_t size = static_cast<uint32_t>(length);
+        std::memcpy(ring.data.get() + offset, &size, sizeof(size));
+        std::memcpy(ring.data.get() + offset + sizeof(size), msg, length);
+        ring.head.store(head + skip + need, std::memory_order_release);
+        return true;
+    }
+
+    void writeBatch() {
+        for (size_t done = 0; done < batch.size();) {
+            ssize_t n = ::write(fd, batch.data() + done, batch.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        batch.clear();
+    }
+
+    // Moves everything published so far into batch and out to the file.
+    void drainOnce() {
+        std::vector<Ring*> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto &ring : rings)
+                snapshot.push_back(ring.get());
+        }
+        for (Ring *ring : snapshot) {
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+            while (tail < head) {
+                size_t offset = tail & (ring->capacity - 1);
+                uint32_t length;
+                std::memcpy(&length, ring->data.get() + offset, sizeof(length));
+                if (length == Ring::wrapMarker) {
+                    tail += ring->capacity - offset;
+                    continue;
+                }
+                batch += prefix;
+                batch.append(ring->data.get() + offset + sizeof(length), length);
+                batch += '\n';
+                tail += recordSize(length);
+                if (batch.size() >= (1 << 20)) {
+                    // hand the space back before the slow part
+                    ring->tail.store(tail, std::memory_order_release);
+                    writeBatch();
+                }
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+        if (!batch.empty())
+            writeBatch();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            changed.wait_for(lock, drainInterval, [this] {
+                return stopping || drainRequests != drainsDone;
+            });
+            uint64_t request = drainRequests;
+            bool last = stopping;
+            lock.unlock();
+            drainOnce();
+            lock.lock();
+            drainsDone = request;
+            changed.notify_all();
+            if (last)
+                return;
+        }
+    }
+public:
+    // `path` empty means stdout. `ringBytes` is per thread and is rounded
+    // up to a power of two.
+    AsyncLogger(const std::string &path = "", const std::string &prefix = "",
+                OverflowPolicy policy = Block, size_t ringBytes = 1 << 20,
+                std::chrono::microseconds drainInterval = std::chrono::microseconds(500)) :
+        prefix(prefix), policy(policy), ringBytes(64), drainInterval(drainInterval),
+        ringsBySlot(new std::atomic<Ring*>[maxThreadSlots]) {
+        for (unsigned i = 0; i < maxThreadSlots; ++i)
+            ringsBySlot[i].store(nullptr, std::memory_order_relaxed);
+        while (this->ringBytes < ringBytes)
+            this->ringBytes *= 2;
+        if (path.empty()) {
+            fd = STDOUT_FILENO;
+            ownsFd = false;
+        } else {
+            fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            ownsFd = fd >= 0;
+            if (fd < 0)
+                std::cerr << "Can't open " << path << " for logging\n";
+        }
+        batch.reserve(1 << 20);
+        drainer = std::thread(&AsyncLogger::run, this);
+    }
+    // Writes out everything logged before the destructor was called.
+    ~AsyncLogger() {
+        std::cout.flush();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            changed.notify_all();
+        }
+        drainer.join();
+        if (ownsFd)
+            close(fd);
+    }
+    AsyncLogger(const AsyncLogger &) = delete;
+    AsyncLogger &operator=(const AsyncLogger &) = delete;
+
+    void log(const std::string &msg) override {
+        if (Ring *ring = ringForThisThread()) {
+            push(*ring, msg.data(), msg.size());
+            return;
+        }
+        std::lock_guard<std::mutex> lock(sharedMutex);
+        if (!sharedRing)
+            sharedRing = newRing();
+        push(*sharedRing, msg.data(), msg.size());
+    }
+    // the largest message that always fits in an empty ring
+    size_t maxMessageSize() const {
+        return ringBytes / 2 - 8;
+    }
+    // Returns once everything logged before the call has been written.
+    void flush() {
+        std::cout.flush();
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t request = ++drainRequests;
+        changed.notify_all();
+        changed.wait(lock, [this, request] { return drainsDone >= request; });
+    }
+    // messages dropped by DropNewest so far
+    uint64_t dropped() {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t total = 0;
+        for (auto &ring : rings)
+            total += ring->dropped.load(std::memory_order_relaxed);
+        return total;
+    }
+    // messages cut to maxMessageSize() so far
+    uint64_t truncated() {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t total = 0;
+        for (auto &ring : rings)
+            total += ring->truncated.load(std::memory_order_relaxed);
+        return total;
+    }
+};
+
+// What a real FileLogger does on the calling thread: take a lock and
+// write with std::endl.
+class SynchronousFileLogger : public Logger {
+    std::ofstream out;
+    std::mutex mutex;
+public:
+    SynchronousFileLogger(const std::string &path) : out(path, std::ios::app) {}
+    void log(const std::string &msg) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        out << msg << std::endl;
+    }
+};
+
+// Average cost of log() per call as seen by the logging threads, each
+// logging `perThread` messages at once.
+void benchmarkLoggers(unsigned threads, size_t perThread, const std::string &path) {
+    std::vector<std::string> messages;
+    for (int i = 0; i < 64; ++i)
+        messages.push_back("Did some stuff, step " + std::to_string(i) + " of the task");
+
+    auto run = [&](Logger &logger) {
+        std::atomic<long long> nanos{0};
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; ++t) {
+            workers.emplace_back([&] {
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < perThread; ++i)
+                    logger.log(messages[i & 63]);
+                nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            });
+        }
+        for (auto &worker : workers)
+            worker.join();
+        return double(nanos) / (threads * perThread);
+    };
+
+    std::cout << "\nLogging " << perThread << " messages from each of "
+              << threads << " threads:\n";
+    std::remove(path.c_str());
+    {
+        SynchronousFileLogger logger(path);
+        std::cout << "synchronous file logger: " << run(logger) << " ns/call" << std::endl;
+    }
+    std::remove(path.c_str());
+    for (auto policy : { AsyncLogger::Block, AsyncLogger::DropNewest }) {
+        auto start = std::chrono::steady_clock::now();
+        AsyncLogger logger(path, "", policy);
+        double perCall = run(logger);
+        logger.flush();
+        std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+        uint64_t dropped = logger.dropped();
+        std::cout << "async logger (" << (policy == AsyncLogger::Block ? "block" : "drop")
+                  << " when full): " << perCall << " ns/call, "
+                  << (threads * perThread - dropped) / total.count() << " msgs/sec written, "
+                  << dropped << " dropped" << std::endl;
+        std::remove(path.c_str());
+    }
+}
+
+// A printf-style format string with a small id, registered once (usually
+// as a function-local static) and then referred to by id in binary logs.
+// Supported conversions: %d %i %u %x %X %f %e %g %s %c and %%. Text
+// longer than UINT16_MAX, or a format past the 65535th, gets invalidId and
+// is never logged.
+class LogFormat {
+    static std::mutex &registryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static std::vector<const char*> &registry() {
+        static std::vector<const char*> formats;
+        return formats;
+    }
+    static uint16_t add(const char *text) {
+        if (std::strlen(text) > UINT16_MAX) {
+            std::cerr << "Log format longer than " << UINT16_MAX << " bytes ignored\n";
+            return invalidId;
+        }
+        std::lock_guard<std::mutex> lock(registryMutex());
+        if (registry().size() >= invalidId) {
+            std::cerr << "More than " << invalidId << " log formats, ignoring " << text << "\n";
+            return invalidId;
+        }
+        registry().push_back(text);
+        return static_cast<uint16_t>(registry().size() - 1);
+    }
+public:
+    static constexpr uint16_t invalidId = UINT16_MAX;
+    const char *const text;
+    const uint16_t id;
+    LogFormat(const char *text) : text(text), id(add(text)) {}
+};
+
+// Records the format id and the raw arguments instead of the formatted
+// text; BinaryLogDecoder does the formatting later, offline. The first
+// time a format is used in a file its text is written to that file too,
+// so every file decodes on its own.
+//
+// File layout: "BLOG", then records. A format record is kind 'F', uint16
+// id, uint16 length, text. An entry is kind 'E', uint16 id, uint8 count,
+// then per argument a type tag and its value: 'i' int64, 'u' uint64,
+// 'f' double, 's' uint16 length + bytes. Numbers are native-endian.
+//
+// Once a file reaches maxBytes the logger moves on to the next one,
+// path.0, path.1, ..., keeping at most keepFiles of them (0 keeps all).
+// If a file can't be opened or written the logger stops and flush()
+// returns false. Entries with an invalid format or a string argument
+// longer than UINT16_MAX are rejected whole and counted by rejected().
+// Not thread-safe: give each thread its own logger or put one behind a
+// lock.
+class BinaryLogger : public Logger {
+    std::string path;
+    size_t maxBytes;
+    unsigned keepFiles;
+    unsigned fileIndex = 0;
+    std::ofstream out;
+    uint64_t fileBytes = 0;
+    uint64_t totalBytes = 0;
+    uint64_t rejectedCount = 0;
+    bool failed = false;
+    std::string buffer;
+    std::vector<bool> definedInFile;
+
+    static constexpr char magic[4] = { 'B', 'L', 'O', 'G' };
+
+    void put(const void *data, size_t size) {
+        buffer.append(static_cast<const char*>(data), size);
+    }
+    template <typename T>
+    void putValue(T value) {
+        put(&value, sizeof(value));
+    }
+    // logf checks the length with fits() first
+    void putString(std::string_view text) {
+        uint16_t length = static_cast<uint16_t>(text.size());
+        buffer += 's';
+        putValue(length);
+        put(text.data(), length);
+    }
+    template <typename T>
+    static bool fits(const T &value) {
+        if constexpr (std::is_arithmetic<typename std::decay<T>::type>::value)
+            return true;
+        else
+            return std::string_view(value).size() <= UINT16_MAX;
+    }
+    template <typename T>
+    void putArgument(const T &value) {
+        typedef typename std::decay<T>::type Type;
+        if constexpr (std::is_same<Type, bool>::value || std::is_same<Type, char>::value) {
+            buffer += 'i';
+            putValue<int64_t>(value);
+        } else if constexpr (std::is_integral<Type>::value && std::is_signed<Type>::value) {
+            buffer += 'i';
+            putValue<int64_t>(value);
+        } else if constexpr (std::is_integral<Type>::value) {
+            buffer += 'u';
+            putValue<uint64_t>(value);
+        } else if constexpr (std::is_floating_point<Type>::value) {
+            buffer += 'f';
+            putValue<double>(value);
+        } else {
+            putString(std::string_view(value));
+        }
+    }
+
+    void writeBuffer() {
+        if (!failed) {
+            out.write(buffer.data(), buffer.size());
+            if (out) {
+                fileBytes += buffer.size();
+                totalBytes += buffer.size();
+            } else {
+                std::cerr << "Can't write " << fileName(fileIndex) << ", logging stopped\n";
+                failed = true;
+            }
+        }
+        buffer.clear();
+    }
+    void openFile() {
+        out.close();
+        if (keepFiles && fileIndex >= keepFiles)
+            std::remove(fileName(fileIndex - keepFiles).c_str());
+        out.open(fileName(fileIndex), std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Can't open " << fileName(fileIndex) << " for logging\n";
+            failed = true;
+        }
+        fileBytes = 0;
+        definedInFile.clear();
+        put(magic, sizeof(magic));
+    }
+    // Starts a record for `format`, rotating first if the file is full.
+    void beginRecord(const LogFormat &format) {
+        if (fileBytes + buffer.size() >= maxBytes) {
+            writeBuffer();
+            fileIndex++;
+            openFile();
+        }
+        if (format.id >= definedInFile.size())
+            definedInFile.resize(format.id + 1);
+        if (!definedInFile[format.id]) {
+            definedInFile[format.id] = true;
+            // LogFormat only hands out ids for text that fits
+            uint16_t length = static_cast<uint16_t>(std::strlen(format.text));
+            buffer += 'F';
+            putValue(format.id);
+            putValue(length);
+            put(format.text, length);
+        }
+        buffer += 'E';
+        putValue(format.id);
+    }
+    void endRecord() {
+        if (buffer.size() >= (1 << 16))
+            writeBuffer();
+    }
+public:
+    BinaryLogger(const std::string &path, size_t maxBytes = 64 << 20, unsigned keepFiles = 0) :
+        path(path), maxBytes(maxBytes), keepFiles(keepFiles) {
+        buffer.reserve(1 << 17);
+        openFile();
+    }
+    ~BinaryLogger() {
+        flush();
+    }
+
+    std::string fileName(unsigned index) const {
+        return path + "." + std::to_string(index);
+    }
+    // index of the file currently being written
+    unsigned currentFile() const {
+        return fileIndex;
+    }
+    // bytes in the files so far, plus what is buffered for them
+    uint64_t bytesWritten() const {
+        return failed ? totalBytes : totalBytes + buffer.size();
+    }
+    // false once a file couldn't be opened or written
+    bool good() const {
+        return !failed;
+    }
+    uint64_t rejected() const {
+        return rejectedCount;
+    }
+
+    template <typename... Args>
+    void logf(const LogFormat &format, const Args &...args) {
+        if (failed)
+            return;
+        if (format.id == LogFormat::invalidId || !(fits(args) && ...)) {
+            if (rejectedCount++ == 0)
+                std::cerr << "Binary log entry rejected: bad format or an argument over "
+                          << UINT16_MAX << " bytes\n";
+            return;
+        }
+        beginRecord(format);
+        buffer += static_cast<char>(sizeof...(args));
+        (putArgument(args), ...);
+        endRecord();
+    }
+    void log(const std::string &msg) override {
+        static const LogFormat plain("%s");
+        logf(plain, msg);
+    }
+    // Returns false if logging has stopped on an I/O error.
+    bool flush() {
+        writeBuffer();
+        if (!failed && !out.flush()) {
+            std::cerr << "Can't write " << fileName(fileIndex) << ", logging stopped\n";
+            failed = true;
+        }
+        return !failed;
+    }
+};
+
+// Turns binary logs back into text, one line per entry.
+class BinaryLogDecoder {
+    struct Argument {
+        char type;
+        int64_t i;
+        uint64_t u;
+        double f;
+        std::string s;
+    };
+
+    // printf with the arguments' recorded types rather than the
+    // conversion letters, so a mismatched format can't misread memory
+    static void format(std::string &line, const std::string &text, const std::vector<Argument> &args) {
+        size_t next = 0;
+        char piece[512];
+        // most conversions fit in `piece`; longer ones (long strings, wide
+        // fields) are formatted again straight into `line`
+        auto append = [&line, &piece](const std::string &spec, auto value) {
+            int n = std::snprintf(piece, sizeof(piece), spec.c_str(), value);
+            if (n <= 0)
+                return;
+            if (static_cast<size_t>(n) < sizeof(piece)) {
+                line.append(piece, n);
+                return;
+            }
+            size_t at = line.size();
+            line.resize(at + n + 1);
+            std::snprintf(&line[at], n + 1, spec.c_str(), value);
+            line.resize(at + n);
+        };
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] != '%') {
+                line += text[i];
+                continue;
+            }
+            size_t start = i++;
+            while (i < text.size() && std::strchr("-+ #0123456789.", text[i]))
+                ++i;
+            if (i == text.size())
+                break;
+            char conversion = text[i];
+            if (conversion == '%') {
+                line += '%';
+                continue;
+            }
+            if (next == args.size()) {
+                line += "<missing>";
+                continue;
+            }
+            const Argument &arg = args[next++];
+            std::string spec = text.substr(start, i - start);
+            if (arg.type == 's') {
+                append(spec + "s", arg.s.c_str());
+            } else if (arg.type == 'f') {
+                bool floating = std::strchr("feEgG", conversion) != nullptr;
+                append(spec + (floating ? conversion : 'g'), arg.f);
+            } else {
+                bool unsignedConversion = std::strchr("uxXo", conversion) != nullptr;
+                if (conversion == 'c')
+                    append(spec + "c", static_cast<int>(arg.i));
+                else if (unsignedConversion || arg.type == 'u')
+                    append(spec + "ll" + (unsignedConversion ? conversion : 'u'),
+                           static_cast<unsigned long long>(arg.type == 'u' ? arg.u : arg.i));
+                else
+                    append(spec + "lld", static_cast<long long>(arg.i));
+            }
+        }
+    }
+public:
+    // Writes the decoded entries of `path` to `out`. Returns the number of
+    // entries, or -1 if the file isn't a binary log. A truncated last
+    // record (the logger died mid-write) is reported and skipped.
+    static long decode(const std::string &path, std::ostream &out) {
+        std::ifstream in(path, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (data.size() < 4 || data.compare(0, 4, "BLOG") != 0) {
+            std::cerr << path << " is not a binary log\n";
+            return -1;
+        }
+        std::vector<std::string> formats;
+        std::vector<Argument> args;
+        std::string line;
+        const char *p = data.data() + 4;
+        const char *end = data.data() + data.size();
+        long entries = 0;
+        bool truncated = false;
+        auto take = [&p, end, &truncated](void *to, size_t size) {
+            if (static_cast<size_t>(end - p) < size) {
+                truncated = true;
+                return false;
+            }
+            std::memcpy(to, p, size);
+            p += size;
+            return true;
+        };
+        while (p < end && !truncated) {
+            char kind = *p++;
+            uint16_t id, length;
+            if (!take(&id, sizeof(id)))
+                break;
+            if (kind == 'F') {
+                if (!take(&length, sizeof(length)))
+                    break;
+                std::string text(length, '\0');
+                if (!take(&text[0], length))
+                    break;
+                if (id >= formats.size())
+                    formats.resize(id + 1);
+                formats[id] = std::move(text);
+                continue;
+            }
+            if (kind != 'E') {
+                std::cerr << path << ": unknown record\n";
+                return entries;
+            }
+            unsigned char count;
+            if (!take(&count, sizeof(count)))
+                break;
+            args.clear();
+            for (size_t i = 0; i < count && !truncated; ++i) {
+                Argument arg = { 0, 0, 0, 0, std::string() };
+                if (!take(&arg.type, sizeof(arg.type)))
+                    break;
+                if (arg.type == 'i') {
+                    take(&arg.i, sizeof(arg.i));
+                } else if (arg.type == 'u') {
+                    take(&arg.u, sizeof(arg.u));
+                } else if (arg.type == 'f') {
+                    take(&arg.f, sizeof(arg.f));
+                } else if (arg.type == 's') {
+                    if (take(&length, sizeof(length))) {
+                        arg.s.resize(length);
+                        take(&arg.s[0], length);
+                    }
+                } else {
+                    std::cerr << path << ": unknown argument type\n";
+                    return entries;
+                }
+                args.push_back(std::move(arg));
+            }
+            if (truncated)
+                break;
+            line.clear();
+            if (id < formats.size())
+                format(line, formats[id], args);
+            else
+                line = "<unknown format " + std::to_string(id) + ">";
+            line += '\n';
+            out.write(line.data(), line.size());
+            entries++;
+        }
+        if (truncated)
+            std::cerr << path << ": truncated last record skipped\n";
+        return entries;
+    }
+};
+
+// Text loggers format on the calling thread; the binary logger only
+// copies the arguments. Compares ns/call and bytes for the same entries,
+// and checks that decoding the binary logs gives back the text log.
+// Returns false if it doesn't.
+bool benchmarkBinaryLogger(size_t calls, const std::string &path) {
+    static const LogFormat stepFormat("Did step %d of %s, took %.3f ms (%u bytes)");
+    const char *tasks[] = { "SomeTask", "ImportTask", "CleanupTask", "ReportTask" };
+    auto args = [&tasks](size_t i) {
+        return std::make_tuple(static_cast<int>(i), tasks[i & 3], (i % 1000) / 7.0,
+                               static_cast<unsigned>(i * 31 % 100000));
+    };
+    char line[256];
+    auto formatLine = [&](size_t i) {
+        auto a = args(i);
+        return std::snprintf(line, sizeof(line), stepFormat.text, std::get<0>(a),
+                             std::get<1>(a), std::get<2>(a), std::get<3>(a));
+    };
+
+    std::cout << "\nLogging " << calls << " formatted messages:\n";
+    std::string textPath = path + ".txt";
+    auto report = [calls](const char *name, std::chrono::steady_clock::duration d, uint64_t bytes) {
+        std::cout << name << std::chrono::duration<double, std::nano>(d).count() / calls
+                  << " ns/call, " << bytes << " bytes" << std::endl;
+    };
+    uint64_t textBytes = 0;
+    {
+        std::ofstream text(textPath, std::ios::trunc);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            int n = formatLine(i);
+            text.write(line, n);
+            text.put('\n');
+        }
+        text.flush();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        textBytes = text.tellp();
+        report("text, snprintf + buffered:  ", elapsed, textBytes);
+    }
+    {
+        std::string endlPath = textPath + ".endl";
+        std::remove(endlPath.c_str());
+        SynchronousFileLogger logger(endlPath);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            int n = formatLine(i);
+            logger.log(std::string(line, n));
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        std::remove(endlPath.c_str());
+        report("text, snprintf + endl:      ", elapsed, textBytes);
+    }
+    unsigned files;
+    uint64_t binaryBytes;
+    bool logged;
+    {
+        BinaryLogger logger(path, 16 << 20);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            auto a = args(i);
+            logger.logf(stepFormat, std::get<0>(a), std::get<1>(a), std::get<2>(a), std::get<3>(a));
+        }
+        logged = logger.flush();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        files = logger.currentFile() + 1;
+        binaryBytes = logger.bytesWritten();
+        report("binary, deferred format:    ", elapsed, binaryBytes);
+    }
+    std::ostringstream decoded;
+    long entries = 0;
+    for (unsigned i = 0; i < files; ++i) {
+        std::string file = path + "." + std::to_string(i);
+        entries += BinaryLogDecoder::decode(file, decoded);
+        std::remove(file.c_str());
+    }
+    std::ifstream text(textPath);
+    std::string expected((std::istreambuf_iterator<char>(text)), std::istreambuf_iterator<char>());
+    std::remove(textPath.c_str());
+    bool same = logged && decoded.str() == expected;
+    std::cout << files << " binary file(s), " << entries << " entries, "
+              << 100.0 * binaryBytes / textBytes << "% of the text size, decoded "
+              << (same ? "identical to" : "DIFFERENT from")
+              << " the text log" << std::endl;
+    return same;
+}
+
+// A logger whose file can't be opened stops and says so, and oversized
+// arguments are rejected rather than cut. Returns the number of failures.
+int checkBinaryLoggerErrors(const std::string &path) {
+    static const LogFormat nameFormat("name %s");
+    int failures = 0;
+    {
+        BinaryLogger logger(path + ".missing/log");
+        logger.logf(nameFormat, "Bob");
+        if (logger.flush() || logger.bytesWritten() != 0)
+            failures++;
+    }
+    {
+        BinaryLogger logger(path);
+        logger.logf(nameFormat, std::string(UINT16_MAX + 1, 'x'));
+        logger.logf(nameFormat, "Bob");
+        logger.logf(nameFormat, std::string(2000, 'y'));
+        if (!logger.flush() || logger.rejected() != 1)
+            failures++;
+    }
+    // strings longer than the decoder's scratch buffer come back whole
+    std::ostringstream decoded;
+    if (BinaryLogDecoder::decode(path + ".0", decoded) != 2 ||
+        decoded.str() != "name Bob\nname " + std::string(2000, 'y') + "\n")
+        failures++;
+    std::remove((path + ".0").c_str());
+    return failures;
+}
+
+// Logger policies for SomeTask. A policy says at compile time whether
+// logging is on, and if so how a message gets written.
+//
+// RuntimeLogging is the classic null-object setup: any Logger chosen at
+// run time, NullLogger by default.
+class RuntimeLogging {
+    Logger *logger;
+public:
+    static constexpr bool enabled = true;
+    RuntimeLogging() : logger(new NullLogger) {}
+    RuntimeLogging(Logger *logger) : logger(logger) {}
+    ~RuntimeLogging() { delete logger; }
+    RuntimeLogging(const RuntimeLogging &) = delete;
+    RuntimeLogging &operator=(const RuntimeLogging &) = delete;
+    void write(const std::string &msg) {
         if (logger) {
-            logger->log("Did some other stuff");
+            logger->log(msg);
+        }
+    }
+};
+
+// A logger fixed at compile time, called directly rather than through
+// the vtable.
+template <typename Sink>
+class StaticLogging {
+    Sink sink;
+public:
+    static constexpr bool enabled = true;
+    void write(const std::string &msg) {
+        sink.Sink::log(msg);
+    }
+};
+
+// No logging at all. SomeTask doesn't even build the messages.
+class NoLogging {
+public:
+    static constexpr bool enabled = false;
+    void write(const std::string &) {}
+};
+
+// Messages are passed as callables that build the string, and are only
+// called when the policy is enabled; with NoLogging the `if constexpr`
+// drops the whole call, so execute() is just the task's own code: see
+// quietSteps() below.
+template <typename LoggerPolicy = RuntimeLogging>
+class SomeTask : private LoggerPolicy {
+    unsigned steps = 0;
+
+    template <typename MakeMessage>
+    void log(MakeMessage makeMessage) {
+        if constexpr (LoggerPolicy::enabled) {
+            LoggerPolicy::write(makeMessage());
         }
     }
+ public:
+    SomeTask() {}
+    SomeTask(Logger *logger) : LoggerPolicy(logger) {}
+    void execute() {
+        log([] { return std::string("Did some stuff"); });
+        // code
+        steps++;
+        log([] { return std::string("Did some other stuff"); });
+    }
+    unsigned stepsDone() const { return steps; }
 };
 
-int main () {
+SomeTask() -> SomeTask<RuntimeLogging>;
+SomeTask(Logger*) -> SomeTask<RuntimeLogging>;
+
+// a quiet task is nothing but its own state
+static_assert(sizeof(SomeTask<NoLogging>) == sizeof(unsigned), "NoLogging should take no space");
+
+// Kept out of line so its code can be inspected on its own. It compiles
+// to a single `steps += runs`: no call, no string, not even a loop. On
+// x86-64, check with
+//
+//   g++ -std=c++17 -O2 -pthread nullobject-pattern.cpp -o nullobject
+//   objdump -d --no-show-raw-insn nullobject |
+//       awk '/<_Z10quietStepsR8SomeTaskI9NoLoggingEm>:/,/ret/'
+//
+// which with GCC 12 prints (addresses vary)
+//
+//   <_Z10quietStepsR8SomeTaskI9NoLoggingEm>:
+//       mov    (%rdi),%eax
+//       test   %rsi,%rsi
+//       je     <_Z10quietStepsR8SomeTaskI9NoLoggingEm+0xb>
+//       add    %esi,%eax
+//       mov    %eax,(%rdi)
+//       ret
+//
+// Piping that through `grep -c call` must print 0.
+__attribute__((noinline)) unsigned quietSteps(SomeTask<NoLogging> &task, size_t runs) {
+    for (size_t i = 0; i < runs; ++i)
+        task.execute();
+    return task.stepsDone();
+}
+
+// ns per execute() with a runtime NullLogger and with the NoLogging policy
+void benchmarkNullLogging(size_t runs) {
+    SomeTask<> runtimeNull;
+    SomeTask<NoLogging> compiledOut;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < runs; ++i)
+        runtimeNull.execute();
+    auto middle = std::chrono::steady_clock::now();
+    unsigned steps = quietSteps(compiledOut, runs);
+    auto end = std::chrono::steady_clock::now();
+
+    auto perRun = [runs](std::chrono::steady_clock::duration d) {
+        return std::chrono::duration<double, std::nano>(d).count() / runs;
+    };
+    std::cout << "\nRunning a task " << runs << " times without logging:\n"
+              << "runtime NullLogger:   " << perRun(middle - start) << " ns/run\n"
+              << "NoLogging policy:     " << perRun(end - middle) << " ns/run"
+              << (steps == runtimeNull.stepsDone() ? "" : " (step counts differ!)") << std::endl;
+}
+
+int main (int argc, char *argv[]) {
+    // offline decoder: nullobject-pattern --decode file...
+    if (argc > 1 && std::string(argv[1]) == "--decode") {
+        for (int i = 2; i < argc; ++i) {
+            if (BinaryLogDecoder::decode(argv[i], std::cout) < 0)
+                return 1;
+        }
+        return 0;
+    }
+
     SomeTask task1(new ConsoleLogger);
     SomeTask task2(new FileLogger);
     SomeTask task3(new ApiLogger);
     SomeTask task4;
+    SomeTask<StaticLogging<ConsoleLogger>> task6;
+    SomeTask<NoLogging> task7;
 
     task1.execute();
     task2.execute();
     task3.execute();
     task4.execute();
+    task6.execute();
+    task7.execute();
 
-    return 0;
+    // the task deletes its logger, which writes out what's left
+    {
+        SomeTask task5(new AsyncLogger("", "Async: "));
+        task5.execute();
+    }
+    {
+        AsyncLogger small("", "Async, small ring: ", AsyncLogger::Block, 64);
+        small.log("Did some stuff, and then a lot more stuff than fits");
+        small.flush();
+        std::cout << small.truncated() << " message(s) cut to " << small.maxMessageSize()
+                  << " bytes" << std::endl;
+    }
+
+    // benchmark logs go to argv[3], or to a temporary file under /tmp
+    std::string path;
+    if (argc > 3) {
+        path = argv[3];
+    } else {
+        char temporary[] = "/tmp/nullobject-benchmarkXXXXXX";
+        int fd = mkstemp(temporary);
+        if (fd < 0) {
+            std::cerr << "Can't create a temporary file\n";
+            return 1;
+        }
+        close(fd);
+        path = temporary;
+    }
+    benchmarkLoggers(argc > 2 ? std::atoi(argv[2]) : 4,
+                     argc > 1 ? std::atol(argv[1]) : 1000000, path);
+    benchmarkNullLogging(argc > 1 ? std::atol(argv[1]) * 10 : 10000000);
+    int failures = checkBinaryLoggerErrors(path + ".check");
+    std::cout << "\nBinary logger error check failures: " << failures << std::endl;
+    bool same = benchmarkBinaryLogger(argc > 1 ? std::atol(argv[1]) : 1000000, path + ".blog");
+    std::remove(path.c_str());
+    return failures == 0 && same ? 0 : 1;
 }
 
@@ -2,16 +2,149 @@
 
 #include<iostream>
 #include<vector>
+#include<memory>
+#include<algorithm>
+#include<chrono>
+#include<cstdlib>
+#include<cstdint>
+#include<deque>
+#include<set>
+#include<string>
+#include<unordered_map>
+#include<mutex>
+#include<condition_variable>
+#include<thread>
+#include<cstring>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+typedef uint32_t ShapeId;
+
+// Every distinct shape name is stored once; canvases and their history
+// carry the small id instead and only look the name up for output.
+// Not synchronized: intern from the editing thread only.
+class ShapeNames {
+    static std::deque<std::string> &names() {
+        static std::deque<std::string> names;  // deque keeps references stable
+        return names;
+    }
+    static std::unordered_map<std::string, ShapeId> &ids() {
+        static std::unordered_map<std::string, ShapeId> ids;
+        return ids;
+    }
+public:
+    static ShapeId intern(const std::string &name) {
+        auto found = ids().find(name);
+        if (found != ids().end())
+            return found->second;
+        ShapeId id = names().size();
+        names().push_back(name);
+        ids().emplace(name, id);
+        return id;
+    }
+    static const std::string &name(ShapeId id) {
+        return names()[id];
+    }
+};
+
+// Shapes in insertion order, kept as an immutable list that grows at the
+// back. Copies share all their nodes, so a snapshot is a pointer copy and
+// undo just swaps back to an older list.
+class ShapeList {
+    struct Node {
+        ShapeId shape;
+        mutable std::shared_ptr<const Node> previous;
+        size_t size;
+        Node(ShapeId shape, std::shared_ptr<const Node> previous) :
+            shape(shape), previous(previous), size(previous ? previous->size + 1 : 1) {}
+        ~Node() {
+            // unlink iteratively, a long list would overflow the stack otherwise
+            std::shared_ptr<const Node> next = std::move(previous);
+            while (next && next.use_count() == 1) {
+                next = std::move(next->previous);
+            }
+        }
+    };
+    std::shared_ptr<const Node> last;
+public:
+    void push_back(ShapeId shape) {
+        last = std::make_shared<const Node>(shape, last);
+    }
+    void pop_back() {
+        if (last)
+            last = last->previous;
+    }
+    void clear() {
+        last.reset();
+    }
+    size_t size() const {
+        return last ? last->size : 0;
+    }
+    std::vector<ShapeId> ids() const {
+        std::vector<ShapeId> shapes(size());
+        size_t i = shapes.size();
+        for (const Node *node = last.get(); node; node = node->previous.get()) {
+            shapes[--i] = node->shape;
+        }
+        return shapes;
+    }
+    std::vector<std::string> toVector() const {
+        std::vector<std::string> shapes;
+        shapes.reserve(size());
+        for (ShapeId id : ids()) {
+            shapes.push_back(ShapeNames::name(id));
+        }
+        return shapes;
+    }
+};
 
 class Canvas;
 class ReplayCanvas;
+class DeltaCanvasHistory;
+class SpillingCanvasHistory;
+class RecordingHistory;
 
 class CanvasMemento {
     friend class Canvas;
     friend class ReplayCanvas;
-    const std::vector<std::string> shapes;
+    friend class DeltaCanvasHistory;
+    friend class SpillingCanvasHistory;
+    friend class RecordingHistory;
+    const ShapeList shapes;
 public:
-    CanvasMemento(std::vector<std::string> shapes) : shapes(shapes) {}
+    CanvasMemento(const ShapeList &shapes) : shapes(shapes) {}
+    size_t shapeCount() const {
+        return shapes.size();
+    }
+    std::vector<ShapeId> shapeIds() const {
+        return shapes.ids();
+    }
+};
+
+// One edit to the canvas, as recorded by DeltaCanvasHistory.
+struct CanvasChange {
+    enum Kind { AddShape, RemoveLastShape, Clear, Replace };
+    Kind kind;
+    ShapeId shape;  // only for AddShape
+
+    void applyTo(ShapeList &shapes) const {
+        switch (kind) {
+        case AddShape:
+            shapes.push_back(shape);
+            break;
+        case RemoveLastShape:
+            shapes.pop_back();
+            break;
+        case Clear:
+            shapes.clear();
+            break;
+        case Replace:
+            // always checkpointed, never replayed
+            break;
+        }
+    }
 };
 
 class CanvasIterator {
@@ -21,7 +154,7 @@ public:
     virtual bool isFinished() = 0;
 };
 
-class ForwardIterator : CanvasIterator {
+class ForwardIterator : public CanvasIterator {
     int currentPosition;
     std::vector<CanvasMemento*> &history;
 public:
@@ -40,11 +173,26 @@ public:
 
 class History {
 public:
+    virtual ~History() {}
     virtual void addState(CanvasMemento *newState) = 0;
     virtual CanvasMemento *undo() = 0;
+    // Records `change`, after which the canvas holds `shapesAfter`.
+    // Histories that keep full states just store the result.
+    virtual void addChange(const CanvasChange &, const ShapeList &shapesAfter) {
+        addState(new CanvasMemento(shapesAfter));
+    }
+};
+
+// Random access to the states of a history, for seeking during replay.
+// Mementos returned by restore() stay owned by the history.
+class CanvasTimeline {
+public:
+    virtual ~CanvasTimeline() {}
+    virtual size_t size() = 0;
+    virtual CanvasMemento *restore(size_t step) = 0;
 };
 
-class CanvasHistory : public History {
+class CanvasHistory : public History, public CanvasTimeline {
     std::vector<CanvasMemento*> oldStates;
 public:
     ~CanvasHistory() {
@@ -63,6 +211,889 @@ public:
     ForwardIterator *getForwardIterator() {
         return new ForwardIterator(oldStates);
     }
+    size_t size() override {
+        return oldStates.size();
+    }
+    CanvasMemento *restore(size_t step) override {
+        return oldStates.at(step);
+    }
+};
+
+// Keeps the list of changes plus a full copy of the shapes every
+// `checkpointInterval` changes. Each step costs one CanvasChange, and
+// rebuilding any state replays at most checkpointInterval changes on top
+// of the nearest earlier checkpoint.
+class DeltaCanvasHistory : public History, public CanvasTimeline {
+    struct Checkpoint {
+        size_t step;
+        ShapeList shapes;
+    };
+    std::vector<CanvasChange> changes;      // changes[i] produced state i
+    std::vector<Checkpoint> checkpoints;    // sorted by step
+    size_t checkpointInterval;
+    CanvasMemento *restored = nullptr;      // last state handed out by undo/restore
+
+    void addCheckpointIfDue(const ShapeList &shapesAfter) {
+        size_t step = changes.size() - 1;
+        if (checkpoints.empty() || step - checkpoints.back().step >= checkpointInterval) {
+            checkpoints.push_back(Checkpoint{ step, shapesAfter });
+        }
+    }
+public:
+    DeltaCanvasHistory(size_t checkpointInterval = 64) :
+        checkpointInterval(std::max<size_t>(checkpointInterval, 1)) {}
+    ~DeltaCanvasHistory() {
+        delete restored;
+    }
+    void addState(CanvasMemento *newState) override {
+        // a state that didn't come with a change is stored in full
+        changes.push_back(CanvasChange{ CanvasChange::Replace, 0 });
+        checkpoints.push_back(Checkpoint{ changes.size() - 1, newState->shapes });
+        delete newState;
+    }
+    void addChange(const CanvasChange &change, const ShapeList &shapesAfter) override {
+        changes.push_back(change);
+        addCheckpointIfDue(shapesAfter);
+    }
+    CanvasMemento *undo() override {
+        if (!changes.empty()) {
+            changes.pop_back();
+            if (!checkpoints.empty() && checkpoints.back().step >= changes.size())
+                checkpoints.pop_back();
+        }
+        return restore(changes.size() - 1);
+    }
+    size_t size() override {
+        return changes.size();
+    }
+    // The shapes after change `step`: the nearest earlier checkpoint plus
+    // the changes since, so at most checkpointInterval changes are applied.
+    ShapeList shapesAt(size_t step) const {
+        ShapeList shapes;
+        if (step < changes.size()) {
+            auto checkpoint = std::upper_bound(checkpoints.begin(), checkpoints.end(), step,
+                                               [](size_t s, const Checkpoint &c) { return s < c.step; });
+            --checkpoint;  // checkpoints[0] is at step 0
+            shapes = checkpoint->shapes;
+            for (size_t i = checkpoint->step + 1; i <= step; ++i) {
+                changes[i].applyTo(shapes);
+            }
+        }
+        return shapes;
+    }
+    const CanvasChange &changeAt(size_t step) const {
+        return changes.at(step);
+    }
+    // Rebuilds the state after change `step`. The memento stays owned by
+    // the history and is valid until the next undo() or restore().
+    CanvasMemento *restore(size_t step) override {
+        delete restored;
+        restored = new CanvasMemento(shapesAt(step));
+        return restored;
+    }
+    // bytes held by the history itself, not counting shared shape nodes
+    size_t bytesHeld() const {
+        return changes.capacity() * sizeof(CanvasChange)
+             + checkpoints.capacity() * sizeof(Checkpoint);
+    }
+    CanvasIterator *getForwardIterator();
+};
+
+// Replays a DeltaCanvasHistory by applying one change per step to the
+// state it produced last; only the first step and stored (Replace) states
+// go back to a checkpoint. The memento returned by next() is owned by the
+// iterator and valid until the following next().
+class DeltaForwardIterator : public CanvasIterator {
+    DeltaCanvasHistory &history;
+    size_t currentPosition = 0;
+    ShapeList shapes;
+    CanvasMemento *current = nullptr;
+public:
+    DeltaForwardIterator(DeltaCanvasHistory &history) : history(history) {}
+    ~DeltaForwardIterator() {
+        delete current;
+    }
+
+    CanvasMemento *next() override {
+        const CanvasChange &change = history.changeAt(currentPosition);
+        if (currentPosition == 0 || change.kind == CanvasChange::Replace)
+            shapes = history.shapesAt(currentPosition);
+        else
+            change.applyTo(shapes);
+        currentPosition++;
+        delete current;
+        current = new CanvasMemento(shapes);
+        return current;
+    }
+    bool isFinished() override {
+        return currentPosition >= history.size();
+    }
+};
+
+CanvasIterator *DeltaCanvasHistory::getForwardIterator() {
+    return new DeltaForwardIterator(*this);
+}
+
+void putVarint(std::string &out, size_t value) {
+    while (value >= 0x80) {
+        out.push_back(char(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(char(value));
+}
+
+// Reads a varint from [in, end). False if it runs past `end` or doesn't
+// fit in a size_t.
+bool getVarint(const char *&in, const char *end, size_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && in < end; shift += 7) {
+        unsigned char b = *in++;
+        value |= size_t(b & 0x7f) << shift;
+        if (b < 0x80)
+            return true;
+    }
+    return false;
+}
+
+// Encoded segment of a history: the checkpoint's shape ids, then each
+// change's kind followed by its shape id for additions, all as varints.
+// Used by the spill file and the saved history format.
+std::string encodeSegment(const ShapeList &checkpoint, const std::vector<CanvasChange> &changes) {
+    std::vector<ShapeId> shapes = checkpoint.ids();
+    std::string out;
+    putVarint(out, shapes.size());
+    for (ShapeId shape : shapes) {
+        putVarint(out, shape);
+    }
+    putVarint(out, changes.size());
+    for (auto &change : changes) {
+        out.push_back(char(change.kind));
+        if (change.kind == CanvasChange::AddShape)
+            putVarint(out, change.shape);
+    }
+    return out;
+}
+
+// Decodes the segment in [p, end). `ids`, if given, translates the ids
+// stored in the segment to ShapeIds. Returns false if the segment is
+// malformed or runs past `end`.
+bool decodeSegment(const char *p, const char *end, ShapeList &checkpoint,
+                   std::vector<CanvasChange> &changes, const std::vector<ShapeId> *ids = nullptr) {
+    auto shapeId = [&p, end, ids](ShapeId &shape) {
+        size_t id;
+        if (!getVarint(p, end, id) || (ids ? id >= ids->size() : id > UINT32_MAX))
+            return false;
+        shape = ids ? (*ids)[id] : ShapeId(id);
+        return true;
+    };
+    size_t count;
+    // every entry takes at least one byte
+    if (!getVarint(p, end, count) || count > size_t(end - p))
+        return false;
+    for (; count > 0; --count) {
+        ShapeId shape;
+        if (!shapeId(shape))
+            return false;
+        checkpoint.push_back(shape);
+    }
+    if (!getVarint(p, end, count) || count > size_t(end - p))
+        return false;
+    changes.resize(count);
+    for (auto &change : changes) {
+        if (p == end || static_cast<unsigned char>(*p) > CanvasChange::Replace)
+            return false;
+        change.kind = CanvasChange::Kind(*p++);
+        change.shape = 0;
+        if (change.kind == CanvasChange::AddShape && !shapeId(change.shape))
+            return false;
+    }
+    return true;
+}
+
+// Delta history that keeps at most `memoryBudget` bytes of changes in
+// memory. The history is cut into segments of `checkpointInterval`
+// changes, each starting at a checkpoint. A background thread encodes the
+// oldest segments past the budget and appends them to a spill file, and
+// reads them back ahead of a deep undo. Editing only takes the lock for
+// bookkeeping, so addShape doesn't wait for disk.
+//
+// Checkpoint shapes are shared with newer states and aren't counted
+// against the budget; only the recorded changes are. If the spill file
+// can't be written, spilling stops and everything stays in memory; if a
+// spilled segment can't be read back, restore() and undo() return nullptr.
+class SpillingCanvasHistory : public History, public CanvasTimeline {
+    struct Segment {
+        size_t index;                       // position in segments
+        size_t firstStep;
+        size_t size = 0;                    // number of changes, kept when spilled
+        ShapeList checkpoint;               // state at firstStep
+        std::vector<CanvasChange> changes;  // changes[0] produced firstStep
+        size_t bytes = 0;                   // resident bytes counted against the budget
+        bool resident = true;
+        bool busy = false;                  // being spilled or loaded by the background thread
+        bool onDisk = false;                // spill file holds an up to date copy
+        off_t offset = 0;
+        size_t length = 0;
+    };
+    std::vector<Segment*> segments;         // sorted by firstStep
+    std::set<size_t> spillable;             // indices of resident, not busy segments
+    size_t steps = 0;
+    size_t checkpointInterval;
+    size_t memoryBudget;
+    size_t residentBytes = 0;
+    size_t spilledBytes = 0;
+    int spillFile = -1;
+    off_t spillEnd = 0;
+    CanvasMemento *restored = nullptr;
+
+    std::mutex lock;
+    std::condition_variable wakeSpiller;
+    std::condition_variable segmentReady;
+    std::vector<Segment*> loadRequests;
+    bool stopping = false;
+    std::thread spiller;
+
+    static size_t bytesFor(const CanvasChange &) {
+        return sizeof(CanvasChange);
+    }
+
+    // Called without the lock; the region is reserved by the caller.
+    bool writeSegment(const std::string &encoded, off_t offset) {
+        ssize_t written = pwrite(spillFile, encoded.data(), encoded.size(), offset);
+        if (written != static_cast<ssize_t>(encoded.size())) {
+            std::cerr << "Can't write canvas history spill file\n";
+            return false;
+        }
+        return true;
+    }
+    bool readSegment(Segment *segment, ShapeList &checkpoint, std::vector<CanvasChange> &changes) {
+        std::string encoded(segment->length, '\0');
+        if (pread(spillFile, &encoded[0], segment->length, segment->offset) !=
+            static_cast<ssize_t>(segment->length)) {
+            std::cerr << "Can't read canvas history spill file\n";
+            return false;
+        }
+        return decodeSegment(encoded.data(), encoded.data() + encoded.size(), checkpoint, changes) &&
+               changes.size() == segment->size;
+    }
+
+    // oldest resident segment that isn't one of the two newest
+    Segment *pickVictim() {
+        if (residentBytes <= memoryBudget || spillable.empty())
+            return nullptr;
+        size_t oldest = *spillable.begin();
+        return oldest + 2 < segments.size() ? segments[oldest] : nullptr;
+    }
+
+    void spill() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wakeSpiller.wait(guard, [this] {
+                return stopping || !loadRequests.empty() || pickVictim() != nullptr;
+            });
+            if (stopping)
+                return;
+            if (!loadRequests.empty()) {
+                Segment *segment = loadRequests.back();
+                loadRequests.pop_back();
+                if (segment->resident || segment->busy)
+                    continue;
+                segment->busy = true;
+                guard.unlock();
+                ShapeList checkpoint;
+                std::vector<CanvasChange> changes;
+                bool read = readSegment(segment, checkpoint, changes);
+                guard.lock();
+                if (read) {
+                    install(segment, checkpoint, changes);
+                } else {
+                    // left on disk; undo retries and reports the failure
+                    segment->busy = false;
+                    segmentReady.notify_all();
+                }
+                continue;
+            }
+            Segment *segment = pickVictim();
+            spillable.erase(segment->index);
+            segment->busy = true;
+            if (!segment->onDisk) {
+                // the segment isn't the newest, so only this thread touches it
+                guard.unlock();
+                std::string encoded = encodeSegment(segment->checkpoint, segment->changes);
+                guard.lock();
+                off_t offset = spillEnd;
+                spillEnd += encoded.size();
+                guard.unlock();
+                bool written = writeSegment(encoded, offset);
+                guard.lock();
+                if (written) {
+                    segment->offset = offset;
+                    segment->length = encoded.size();
+                    segment->onDisk = true;
+                    spilledBytes += encoded.size();
+                } else {
+                    // don't keep retrying a failing disk
+                    std::cerr << "Keeping the rest of the canvas history in memory\n";
+                    memoryBudget = SIZE_MAX;
+                }
+            }
+            if (segment->onDisk) {
+                std::vector<CanvasChange>().swap(segment->changes);
+                segment->checkpoint.clear();
+                segment->resident = false;
+                residentBytes -= segment->bytes;
+            } else {
+                spillable.insert(segment->index);
+            }
+            segment->busy = false;
+            segmentReady.notify_all();
+        }
+    }
+
+    void install(Segment *segment, const ShapeList &checkpoint, std::vector<CanvasChange> &changes) {
+        segment->checkpoint = checkpoint;
+        segment->changes.swap(changes);
+        segment->resident = true;
+        segment->busy = false;
+        residentBytes += segment->bytes;
+        spillable.insert(segment->index);
+        segmentReady.notify_all();
+    }
+
+    // Waits out the background thread and loads the segment if needed.
+    // Returns false if it couldn't be read back.
+    bool ensureResident(Segment *segment, std::unique_lock<std::mutex> &guard) {
+        segmentReady.wait(guard, [segment] { return !segment->busy; });
+        if (segment->resident)
+            return true;
+        ShapeList checkpoint;
+        std::vector<CanvasChange> changes;
+        if (!readSegment(segment, checkpoint, changes))
+            return false;
+        install(segment, checkpoint, changes);
+        wakeSpiller.notify_one();
+        return true;
+    }
+    Segment *newSegment(size_t firstStep, const ShapeList &checkpoint) {
+        Segment *segment = new Segment;
+        segment->index = segments.size();
+        segment->firstStep = firstStep;
+        segment->checkpoint = checkpoint;
+        segments.push_back(segment);
+        spillable.insert(segment->index);
+        return segment;
+    }
+
+    Segment *segmentFor(size_t step) {
+        auto it = std::upper_bound(segments.begin(), segments.end(), step,
+                                   [](size_t s, const Segment *seg) { return s < seg->firstStep; });
+        return *(it - 1);
+    }
+
+    CanvasMemento *restoreLocked(size_t step, std::unique_lock<std::mutex> &guard) {
+        ShapeList shapes;
+        if (step < steps) {
+            Segment *segment = segmentFor(step);
+            if (!ensureResident(segment, guard))
+                return nullptr;
+            shapes = segment->checkpoint;
+            for (size_t i = 1; i <= step - segment->firstStep; ++i) {
+                segment->changes[i].applyTo(shapes);
+            }
+        }
+        delete restored;
+        restored = new CanvasMemento(shapes);
+        return restored;
+    }
+public:
+    SpillingCanvasHistory(size_t memoryBudget, size_t checkpointInterval = 1024) :
+        checkpointInterval(std::max<size_t>(checkpointInterval, 1)), memoryBudget(memoryBudget) {
+        char path[] = "/tmp/canvas-historyXXXXXX";
+        spillFile = mkstemp(path);
+        if (spillFile < 0) {
+            std::cerr << "Can't create canvas history spill file, keeping everything in memory\n";
+            this->memoryBudget = SIZE_MAX;
+        } else {
+            // only ever reached through our descriptor
+            unlink(path);
+        }
+        spiller = std::thread(&SpillingCanvasHistory::spill, this);
+    }
+    ~SpillingCanvasHistory() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeSpiller.notify_one();
+        spiller.join();
+        if (spillFile >= 0)
+            close(spillFile);
+        for (auto segment : segments) {
+            delete segment;
+        }
+        delete restored;
+    }
+    void addState(CanvasMemento *newState) override {
+        std::unique_lock<std::mutex> guard(lock);
+        Segment *segment = newSegment(steps++, newState->shapes);
+        segment->changes.push_back(CanvasChange{ CanvasChange::Replace, 0 });
+        segment->size = 1;
+        segment->bytes = bytesFor(segment->changes.back());
+        residentBytes += segment->bytes;
+        delete newState;
+    }
+    void addChange(const CanvasChange &change, const ShapeList &shapesAfter) override {
+        std::unique_lock<std::mutex> guard(lock);
+        Segment *segment = segments.empty() ? nullptr : segments.back();
+        if (!segment || segment->size >= checkpointInterval) {
+            segment = newSegment(steps, shapesAfter);
+        }
+        // the newest segment is never spilled, so it is always resident
+        segment->changes.push_back(change);
+        segment->size++;
+        segment->onDisk = false;
+        segment->bytes += bytesFor(change);
+        residentBytes += bytesFor(change);
+        steps++;
+        if (residentBytes > memoryBudget)
+            wakeSpiller.notify_one();
+    }
+    CanvasMemento *undo() override {
+        std::unique_lock<std::mutex> guard(lock);
+        if (steps > 0) {
+            Segment *segment = segments.back();
+            // only fails if an earlier undo couldn't read this one back
+            if (!ensureResident(segment, guard))
+                return nullptr;
+            residentBytes -= bytesFor(segment->changes.back());
+            segment->bytes -= bytesFor(segment->changes.back());
+            segment->changes.pop_back();
+            segment->size--;
+            segment->onDisk = false;
+            steps--;
+            if (segment->size == 0) {
+                segments.pop_back();
+                spillable.erase(segment->index);
+                // a prefetch may still be queued for it
+                loadRequests.erase(std::remove(loadRequests.begin(), loadRequests.end(), segment),
+                                   loadRequests.end());
+                delete segment;
+                if (!segments.empty()) {
+                    // the previous segment becomes the one being edited
+                    if (!ensureResident(segments.back(), guard))
+                        return nullptr;
+                    segments.back()->onDisk = false;
+                }
+                // read the next one back in before undo gets there
+                if (segments.size() >= 2 && !segments[segments.size() - 2]->resident) {
+                    loadRequests.push_back(segments[segments.size() - 2]);
+                    wakeSpiller.notify_one();
+                }
+            }
+        }
+        return restoreLocked(steps - 1, guard);
+    }
+    size_t size() override {
+        std::lock_guard<std::mutex> guard(lock);
+        return steps;
+    }
+    // State after change `step`; owned by the history until the next
+    // undo() or restore(). nullptr if it couldn't be read back from disk.
+    CanvasMemento *restore(size_t step) override {
+        std::unique_lock<std::mutex> guard(lock);
+        return restoreLocked(step, guard);
+    }
+    size_t bytesInMemory() {
+        std::lock_guard<std::mutex> guard(lock);
+        return residentBytes;
+    }
+    size_t bytesSpilled() {
+        std::lock_guard<std::mutex> guard(lock);
+        return spilledBytes;
+    }
+};
+
+/* Saved history file, version 1. Fixed-size fields are native-endian.
+
+   header   "CNVH", u32 version
+   blocks   encodeSegment() of every `blockSize` changes, back to back
+   names    varint count, then varint length + bytes for each name
+   index    per block: u64 first step, u64 offset, u64 length
+   footer   u64 names offset, u64 index offset, u64 block count,
+            u64 step count, "CNVH"
+
+   Blocks are appended while editing goes on; names, index and footer are
+   written when recording finishes. The ids inside the blocks are indexes
+   into the names table.
+*/
+const char historyMagic[4] = { 'C', 'N', 'V', 'H' };
+const uint32_t historyVersion = 1;
+
+struct HistoryIndexEntry {
+    uint64_t firstStep;
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct HistoryFooter {
+    uint64_t namesOffset;
+    uint64_t indexOffset;
+    uint64_t blockCount;
+    uint64_t steps;
+    char magic[4];
+    uint32_t reserved;          // written as 0; makes the padding explicit
+};
+
+// Passes everything through to another history and saves it to `path`
+// as it goes. Full blocks are encoded and appended by a background
+// thread, so editing never waits for the disk. Undoing past the last
+// written block is the one exception: it waits for the writer, reads the
+// block back and truncates the file. If the file can't be created or
+// written, recording stops and good() returns false; editing goes on.
+class RecordingHistory : public History {
+    struct Block {
+        size_t firstStep;
+        ShapeList checkpoint;               // state at firstStep
+        std::vector<CanvasChange> changes;  // changes[0] produced firstStep
+    };
+    History *history;
+    size_t blockSize;
+    size_t steps = 0;
+    Block pending;
+    ShapeId largestId = 0;
+
+    int file = -1;
+    bool failed = false;                // guarded by lock once writer runs
+    std::mutex lock;
+    std::condition_variable wakeWriter;
+    std::condition_variable writerIdle;
+    std::deque<Block> queue;
+    bool writing = false;
+    bool stopping = false;
+    std::vector<HistoryIndexEntry> index;
+    uint64_t fileEnd = 0;
+    std::thread writer;
+
+    void write() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wakeWriter.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            Block block = std::move(queue.front());
+            queue.pop_front();
+            writing = true;
+            uint64_t offset = fileEnd;
+            guard.unlock();
+            bool written = false;
+            std::string encoded;
+            if (!failed) {
+                encoded = encodeSegment(block.checkpoint, block.changes);
+                written = pwrite(file, encoded.data(), encoded.size(), offset) ==
+                          static_cast<ssize_t>(encoded.size());
+            }
+            guard.lock();
+            if (written) {
+                index.push_back(HistoryIndexEntry{ block.firstStep, offset, encoded.size() });
+                fileEnd += encoded.size();
+            } else if (!failed) {
+                // a gap would leave steps missing from the file
+                std::cerr << "Can't write canvas history file, recording stopped\n";
+                failed = true;
+            }
+            writing = false;
+            writerIdle.notify_all();
+        }
+    }
+
+    void noteShape(ShapeId shape) {
+        largestId = std::max(largestId, shape);
+    }
+    void record(const CanvasChange &change, const ShapeList &shapesAfter) {
+        if (change.kind == CanvasChange::AddShape)
+            noteShape(change.shape);
+        if (pending.changes.empty()) {
+            pending.firstStep = steps;
+            pending.checkpoint = shapesAfter;
+        }
+        pending.changes.push_back(change);
+        steps++;
+        if (pending.changes.size() >= blockSize) {
+            std::lock_guard<std::mutex> guard(lock);
+            queue.push_back(std::move(pending));
+            pending = Block();
+            wakeWriter.notify_one();
+        }
+    }
+    // Brings the last block back from the queue or the file.
+    bool reopenLastBlock() {
+        std::unique_lock<std::mutex> guard(lock);
+        if (!queue.empty()) {
+            pending = std::move(queue.back());
+            queue.pop_back();
+            return true;
+        }
+        writerIdle.wait(guard, [this] { return !writing; });
+        if (!queue.empty()) {
+            pending = std::move(queue.back());
+            queue.pop_back();
+            return true;
+        }
+        if (index.empty())
+            return false;
+        HistoryIndexEntry last = index.back();
+        std::string encoded(last.length, '\0');
+        if (pread(file, &encoded[0], last.length, last.offset) != static_cast<ssize_t>(last.length)) {
+            std::cerr << "Can't read canvas history file\n";
+            return false;
+        }
+        pending = Block();
+        pending.firstStep = last.firstStep;
+        if (!decodeSegment(encoded.data(), encoded.data() + encoded.size(),
+                           pending.checkpoint, pending.changes)) {
+            std::cerr << "Canvas history file is corrupt\n";
+            pending = Block();
+            return false;
+        }
+        index.pop_back();
+        fileEnd = last.offset;
+        if (ftruncate(file, fileEnd) != 0)
+            std::cerr << "Can't truncate canvas history file\n";
+        return true;
+    }
+public:
+    RecordingHistory(History *history, const std::string &path, size_t blockSize = 256) :
+        history(history), blockSize(std::max<size_t>(blockSize, 1)) {
+        file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file < 0) {
+            std::cerr << "Can't create " << path << ", not recording\n";
+            failed = true;
+        } else {
+            std::string header(historyMagic, sizeof(historyMagic));
+            header.append(reinterpret_cast<const char*>(&historyVersion), sizeof(historyVersion));
+            if (pwrite(file, header.data(), header.size(), 0) == static_cast<ssize_t>(header.size())) {
+                fileEnd = header.size();
+            } else {
+                std::cerr << "Can't write " << path << ", not recording\n";
+                failed = true;
+            }
+        }
+        writer = std::thread(&RecordingHistory::write, this);
+    }
+    ~RecordingHistory() {
+        finish();
+    }
+    // Writes the last block, names, index and footer and closes the file.
+    void finish() {
+        if (!writer.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!pending.changes.empty())
+                queue.push_back(std::move(pending));
+            pending = Block();
+            stopping = true;
+        }
+        wakeWriter.notify_one();
+        writer.join();
+        if (file < 0)
+            return;
+        if (failed) {
+            close(file);
+            file = -1;
+            return;
+        }
+
+        std::string tail;
+        size_t nameCount = steps > 0 ? largestId + 1 : 0;
+        putVarint(tail, nameCount);
+        for (ShapeId id = 0; id < nameCount; ++id) {
+            putVarint(tail, ShapeNames::name(id).size());
+            tail += ShapeNames::name(id);
+        }
+        HistoryFooter footer{};
+        footer.namesOffset = fileEnd;
+        footer.indexOffset = fileEnd + tail.size();
+        footer.blockCount = index.size();
+        footer.steps = steps;
+        std::memcpy(footer.magic, historyMagic, sizeof(historyMagic));
+        tail.append(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(HistoryIndexEntry));
+        tail.append(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        if (pwrite(file, tail.data(), tail.size(), fileEnd) != static_cast<ssize_t>(tail.size())) {
+            std::cerr << "Can't write canvas history file\n";
+            failed = true;
+        }
+        close(file);
+        file = -1;
+    }
+    // false once the file couldn't be created or written
+    bool good() {
+        std::lock_guard<std::mutex> guard(lock);
+        return !failed;
+    }
+    void addState(CanvasMemento *newState) override {
+        ShapeList shapes = newState->shapes;
+        for (ShapeId shape : shapes.ids()) {
+            noteShape(shape);
+        }
+        history->addState(newState);
+        // a full state always starts a new block
+        if (!pending.changes.empty()) {
+            std::lock_guard<std::mutex> guard(lock);
+            queue.push_back(std::move(pending));
+            pending = Block();
+            wakeWriter.notify_one();
+        }
+        record(CanvasChange{ CanvasChange::Replace, 0 }, shapes);
+    }
+    void addChange(const CanvasChange &change, const ShapeList &shapesAfter) override {
+        history->addChange(change, shapesAfter);
+        record(change, shapesAfter);
+    }
+    CanvasMemento *undo() override {
+        if (steps > 0 && (!pending.changes.empty() || reopenLastBlock())) {
+            pending.changes.pop_back();
+            steps--;
+        }
+        return history->undo();
+    }
+};
+
+// A history saved by RecordingHistory, mapped read-only. Opening reads
+// the footer and the names and checks the index; a state's block is
+// decoded only when that state is restored, so opening never decodes a
+// block.
+class SavedCanvasHistory : public CanvasTimeline {
+    void *mapping = nullptr;
+    size_t mappedBytes = 0;
+    const char *data = nullptr;
+    HistoryFooter footer = {};
+    std::vector<ShapeId> ids;           // file id -> ShapeId
+    // the block decoded last, reused by neighbouring restores
+    size_t decodedBlock = SIZE_MAX;
+    ShapeList checkpoint;
+    std::vector<CanvasChange> changes;
+    CanvasMemento *restored = nullptr;
+
+    HistoryIndexEntry entry(size_t block) const {
+        HistoryIndexEntry e;
+        std::memcpy(&e, data + footer.indexOffset + block * sizeof(HistoryIndexEntry), sizeof(e));
+        return e;
+    }
+    // Everything taken from the file is checked against the mapping: the
+    // sections have to be in order, names have to stay inside the names
+    // section and blocks inside the block section, in step order.
+    bool load() {
+        const uint64_t headerSize = sizeof(historyMagic) + sizeof(historyVersion);
+        if (mappedBytes < headerSize + sizeof(HistoryFooter))
+            return false;
+        uint32_t version;
+        std::memcpy(&version, data + sizeof(historyMagic), sizeof(version));
+        std::memcpy(&footer, data + mappedBytes - sizeof(footer), sizeof(footer));
+        uint64_t indexEnd = mappedBytes - sizeof(footer);
+        if (std::memcmp(data, historyMagic, sizeof(historyMagic)) != 0 ||
+            std::memcmp(footer.magic, historyMagic, sizeof(historyMagic)) != 0 ||
+            version != historyVersion ||
+            footer.indexOffset > indexEnd ||
+            footer.blockCount != (indexEnd - footer.indexOffset) / sizeof(HistoryIndexEntry) ||
+            footer.indexOffset + footer.blockCount * sizeof(HistoryIndexEntry) != indexEnd ||
+            footer.namesOffset < headerSize || footer.namesOffset > footer.indexOffset ||
+            (footer.steps > 0) != (footer.blockCount > 0))
+            return false;
+        for (size_t block = 0; block < footer.blockCount; ++block) {
+            HistoryIndexEntry e = entry(block);
+            if (e.offset < headerSize || e.offset > footer.namesOffset ||
+                e.length > footer.namesOffset - e.offset || e.firstStep >= footer.steps ||
+                (block == 0 ? e.firstStep != 0 : e.firstStep <= entry(block - 1).firstStep))
+                return false;
+        }
+        const char *p = data + footer.namesOffset;
+        const char *end = data + footer.indexOffset;
+        size_t count;
+        if (!getVarint(p, end, count) || count > size_t(end - p))
+            return false;
+        ids.resize(count);
+        for (auto &id : ids) {
+            size_t length;
+            if (!getVarint(p, end, length) || length > size_t(end - p))
+                return false;
+            id = ShapeNames::intern(std::string(p, length));
+            p += length;
+        }
+        return true;
+    }
+public:
+    SavedCanvasHistory(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Can't open " << path << "\n";
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            mappedBytes = info.st_size;
+            mapping = mmap(nullptr, mappedBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                mapping = nullptr;
+            } else {
+                data = static_cast<const char*>(mapping);
+            }
+        }
+        close(fd);
+        if (!mapping || !load()) {
+            std::cerr << path << " is not a canvas history\n";
+            footer = HistoryFooter{};
+        }
+    }
+    ~SavedCanvasHistory() {
+        if (mapping)
+            munmap(mapping, mappedBytes);
+        delete restored;
+    }
+    SavedCanvasHistory(const SavedCanvasHistory &) = delete;
+    SavedCanvasHistory &operator=(const SavedCanvasHistory &) = delete;
+
+    size_t size() override {
+        return footer.steps;
+    }
+    // nullptr if the block holding `step` is corrupt
+    CanvasMemento *restore(size_t step) override {
+        ShapeList shapes;
+        if (step < footer.steps) {
+            // last block starting at or before `step`
+            size_t low = 0, high = footer.blockCount;
+            while (high - low > 1) {
+                size_t middle = (low + high) / 2;
+                if (entry(middle).firstStep <= step)
+                    low = middle;
+                else
+                    high = middle;
+            }
+            HistoryIndexEntry block = entry(low);
+            if (decodedBlock != low) {
+                checkpoint.clear();
+                decodedBlock = SIZE_MAX;
+                if (!decodeSegment(data + block.offset, data + block.offset + block.length,
+                                   checkpoint, changes, &ids)) {
+                    std::cerr << "Canvas history block " << low << " is corrupt\n";
+                    return nullptr;
+                }
+                decodedBlock = low;
+            }
+            if (step - block.firstStep >= changes.size()) {
+                std::cerr << "Canvas history block " << low << " is missing steps\n";
+                return nullptr;
+            }
+            shapes = checkpoint;
+            for (size_t i = 1; i <= step - block.firstStep; ++i) {
+                changes[i].applyTo(shapes);
+            }
+        }
+        delete restored;
+        restored = new CanvasMemento(shapes);
+        return restored;
+    }
 };
 
 class NullHistory : public History {
@@ -71,48 +1102,382 @@ public:
 };
 
 class Canvas {
-    std::vector<std::string> shapes;
+    ShapeList shapes;
     History *history = nullptr;
 public:
     Canvas(History *history) : history(history) {}
     void addShape(const std::string &newShape) {
-        shapes.push_back(newShape);
-        history->addState(new CanvasMemento(shapes));
+        ShapeId id = ShapeNames::intern(newShape);
+        shapes.push_back(id);
+        history->addChange(CanvasChange{ CanvasChange::AddShape, id }, shapes);
+    }
+    void removeLastShape() {
+        shapes.pop_back();
+        history->addChange(CanvasChange{ CanvasChange::RemoveLastShape, 0 }, shapes);
     }
     void undo() {
         CanvasMemento *previousState = history->undo();
+        if (!previousState) {
+            std::cerr << "Can't undo: the previous state is unavailable\n";
+            return;
+        }
         shapes = previousState->shapes;
     }
     void clearAll() {
         shapes.clear();
-        history->addState(new CanvasMemento(shapes));
+        history->addChange(CanvasChange{ CanvasChange::Clear, 0 }, shapes);
     }
     std::vector<std::string> getShapes() {
-        return shapes;
+        return shapes.toVector();
     }
 };
 
+// Plays back a history. replay() walks it from the start; seek() and
+// play() jump straight to any step through the history's timeline, so
+// states that are skipped over are never built. Output is collected in
+// a buffer and written in large chunks.
 class ReplayCanvas {
-    std::vector<std::string> shapes;
-    ForwardIterator *historyIterator;
+    ShapeList shapes;
+    CanvasIterator *historyIterator = nullptr;
+    CanvasTimeline *timeline;
+    std::string output;
+    static const size_t flushThreshold = 1 << 16;
+
+    void showCurrent() {
+        output += "The shapes are now: ";
+        for (ShapeId shape : shapes.ids()) {
+            output += ShapeNames::name(shape);
+            output += ", ";
+        }
+        output += "\n";
+        if (output.size() >= flushThreshold)
+            flush();
+    }
+    void flush() {
+        std::cout.write(output.data(), output.size());
+        output.clear();
+    }
 public:
-    ReplayCanvas(CanvasHistory *history) {
+    ReplayCanvas(CanvasHistory *history) : timeline(history) {
+        historyIterator = history->getForwardIterator();
+    }
+    ReplayCanvas(DeltaCanvasHistory *history) : timeline(history) {
         historyIterator = history->getForwardIterator();
     }
+    ReplayCanvas(CanvasTimeline *timeline) : timeline(timeline) {}
+    ~ReplayCanvas() {
+        delete historyIterator;
+    }
     void replay() {
+        if (!historyIterator) {
+            if (timeline->size() > 0)
+                play(0, timeline->size() - 1);
+            return;
+        }
         while(!historyIterator->isFinished()) {
             CanvasMemento *nextState = historyIterator->next();
             shapes = nextState->shapes;
-            std::cout << "The shapes are now: ";
-            for (auto &shape : shapes) {
-                std::cout << shape << ", ";
-            }
-            std::cout << "\n";
+            showCurrent();
+        }
+        flush();
+    }
+    // Moves to the state after change `step` without showing it.
+    void seek(size_t step) {
+        CanvasMemento *state = timeline->restore(step);
+        if (state)
+            shapes = state->shapes;
+        else
+            std::cerr << "Can't seek to step " << step << "\n";
+    }
+    size_t shapeCount() const {
+        return shapes.size();
+    }
+    // Shows every `stride`-th state from `from` to `to`, both included as
+    // far as the stride allows. Plays in reverse when `to` is before `from`.
+    void play(size_t from, size_t to, size_t stride = 1) {
+        size_t size = timeline->size();
+        if (size == 0)
+            return;
+        from = std::min(from, size - 1);
+        to = std::min(to, size - 1);
+        stride = std::max<size_t>(stride, 1);
+        for (size_t step = from; ; ) {
+            seek(step);
+            showCurrent();
+            size_t left = from <= to ? to - step : step - to;
+            if (left < stride)
+                break;
+            step = from <= to ? step + stride : step - stride;
         }
+        flush();
     }
 };
 
-int main() {
+// Memory and random-restore cost of DeltaCanvasHistory for a range of
+// checkpoint intervals, over `edits` edits.
+void benchmarkCheckpointInterval(size_t edits) {
+    std::cout << "\nDelta history, " << edits << " edits:\n";
+    for (size_t interval : { 1, 4, 16, 64, 256, 1024 }) {
+        DeltaCanvasHistory *history = new DeltaCanvasHistory(interval);
+        Canvas *canvas = new Canvas(history);
+        for (size_t i = 0; i < edits; ++i) {
+            if (i % 1000 == 999)
+                canvas->clearAll();
+            else if (i % 10 == 9)
+                canvas->removeLastShape();
+            else
+                canvas->addShape("square");
+        }
+
+        const int restores = 100000;
+        std::srand(7);
+        size_t totalShapes = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < restores; ++i) {
+            totalShapes += history->restore(std::rand() % edits)->shapeCount();
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << "K=" << interval << ": "
+                  << double(history->bytesHeld()) / edits << " bytes/step, "
+                  << elapsed.count() / restores << " ns/restore"
+                  << " (" << totalShapes << " shapes restored)\n";
+        delete canvas;
+        delete history;
+    }
+}
+
+// addShape latency under a small memory budget, then a deep undo and
+// random restores checked against an in-memory DeltaCanvasHistory.
+void benchmarkSpilling(size_t edits) {
+    SpillingCanvasHistory *history = new SpillingCanvasHistory(1 << 20, 256);
+    DeltaCanvasHistory *reference = new DeltaCanvasHistory(256);
+    Canvas *canvas = new Canvas(history);
+    Canvas *referenceCanvas = new Canvas(reference);
+    const char *names[] = { "rhombus", "triangle", "square", "circle", "a rather long shape name" };
+
+    std::vector<double> latencies(edits);
+    for (size_t i = 0; i < edits; ++i) {
+        const char *name = names[i % 5];
+        auto start = std::chrono::steady_clock::now();
+        if (i % 1000 == 999)
+            canvas->clearAll();
+        else
+            canvas->addShape(name);
+        latencies[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        if (i % 1000 == 999)
+            referenceCanvas->clearAll();
+        else
+            referenceCanvas->addShape(name);
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    size_t undos = std::min<size_t>(edits - 1, 200000);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < undos; ++i) {
+        canvas->undo();
+    }
+    std::chrono::duration<double, std::nano> undoTime = std::chrono::steady_clock::now() - start;
+    for (size_t i = 0; i < undos; ++i) {
+        referenceCanvas->undo();
+    }
+
+    size_t mismatches = 0;
+    std::srand(11);
+    for (int i = 0; i < 1000; ++i) {
+        size_t step = std::rand() % history->size();
+        if (history->restore(step)->shapeCount() != reference->restore(step)->shapeCount())
+            mismatches++;
+    }
+    bool sameShapes = canvas->getShapes() == referenceCanvas->getShapes();
+
+    std::cout << "\nSpilling history, " << edits << " edits, 1 MiB budget:\n"
+              << "addShape p50 " << latencies[edits / 2] << " ns, p99 "
+              << latencies[edits * 99 / 100] << " ns, max " << latencies.back() << " ns\n"
+              << history->bytesInMemory() / 1024 << " KiB in memory, "
+              << history->bytesSpilled() / 1024 << " KiB spilled\n"
+              << undos << " undos: " << undoTime.count() / undos << " ns each, "
+              << mismatches << " restore mismatches"
+              << (sameShapes ? "" : ", canvas differs after undo!") << "\n";
+
+    delete canvas;
+    delete referenceCanvas;
+    delete history;
+    delete reference;
+}
+
+// Cost of jumping to random steps of a long delta history.
+void benchmarkScrubbing(size_t edits) {
+    DeltaCanvasHistory *history = new DeltaCanvasHistory(64);
+    Canvas *canvas = new Canvas(history);
+    for (size_t i = 0; i < edits; ++i) {
+        if (i % 1000 == 999)
+            canvas->clearAll();
+        else
+            canvas->addShape("square");
+    }
+    ReplayCanvas *replay = new ReplayCanvas(history);
+
+    const int seeks = 100000;
+    size_t totalShapes = 0;
+    std::srand(3);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < seeks; ++i) {
+        replay->seek(std::rand() % edits);
+        totalShapes += replay->shapeCount();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "\nScrubbing " << edits << " steps: "
+              << elapsed.count() / seeks << " ns per seek"
+              << " (" << totalShapes << " shapes)\n";
+
+    delete replay;
+    delete canvas;
+    delete history;
+}
+
+// Damaged copies of the saved history at `path` have to be rejected when
+// opened, or fail in restore(), without reading outside the file; and a
+// recording that can't create its file has to say so. Returns the number
+// of cases that went unnoticed.
+int checkDamagedHistory(const char *path) {
+    std::string original;
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    original.resize(info.st_size);
+    bool read = pread(fd, &original[0], original.size(), 0) == static_cast<ssize_t>(original.size());
+    close(fd);
+    HistoryFooter footer;
+    if (!read || original.size() < sizeof(footer))
+        return 1;
+    std::memcpy(&footer, original.data() + original.size() - sizeof(footer), sizeof(footer));
+
+    std::string damagedPath = std::string(path) + ".damaged";
+    auto opens = [&damagedPath](const std::string &bytes) {
+        int out = open(damagedPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0)
+            return false;
+        bool written = ::write(out, bytes.data(), bytes.size()) == static_cast<ssize_t>(bytes.size());
+        close(out);
+        if (!written)
+            return false;
+        SavedCanvasHistory saved(damagedPath);
+        bool restored = saved.size() > 0;
+        for (size_t step = 0; step < saved.size(); step += 97) {
+            restored = saved.restore(step) != nullptr && restored;
+        }
+        return restored;
+    };
+    auto withFooter = [&original](const HistoryFooter &changed) {
+        std::string bytes = original;
+        std::memcpy(&bytes[bytes.size() - sizeof(changed)], &changed, sizeof(changed));
+        return bytes;
+    };
+    int accepted = 0;
+    HistoryFooter bad = footer;
+    bad.namesOffset = footer.indexOffset + 1;
+    accepted += opens(withFooter(bad));
+    bad = footer;
+    bad.namesOffset = footer.indexOffset - 1;     // the names run past their section
+    accepted += opens(withFooter(bad));
+    bad = footer;
+    bad.blockCount = footer.blockCount + 1000;
+    accepted += opens(withFooter(bad));
+    if (footer.blockCount > 0) {
+        std::string bytes = original;
+        HistoryIndexEntry last;
+        size_t at = footer.indexOffset + (footer.blockCount - 1) * sizeof(last);
+        std::memcpy(&last, bytes.data() + at, sizeof(last));
+        last.length = footer.namesOffset;           // runs into the names
+        std::memcpy(&bytes[at], &last, sizeof(last));
+        accepted += opens(bytes);
+        // a block of garbage
+        std::memcpy(&last, original.data() + at, sizeof(last));
+        std::string garbage = original;
+        std::fill(garbage.begin() + last.offset, garbage.begin() + last.offset + last.length, '\xff');
+        accepted += opens(garbage);
+    }
+    accepted += opens(original.substr(0, original.size() / 2));
+    unlink(damagedPath.c_str());
+
+    DeltaCanvasHistory nothing(256);
+    RecordingHistory unrecorded(&nothing, std::string(path) + ".missing/history");
+    unrecorded.addChange(CanvasChange{ CanvasChange::AddShape, 0 }, ShapeList());
+    unrecorded.finish();
+    accepted += unrecorded.good();
+    return accepted;
+}
+
+// Records a long history to disk while editing, then maps it back and
+// compares restored states with the in-memory history.
+void benchmarkSaving(size_t edits) {
+    char path[] = "/tmp/canvas-savedXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        std::cerr << "Can't create a temporary file\n";
+        return;
+    }
+    close(fd);
+
+    DeltaCanvasHistory *history = new DeltaCanvasHistory(256);
+    RecordingHistory *recording = new RecordingHistory(history, path);
+    Canvas *canvas = new Canvas(recording);
+    const char *names[] = { "rhombus", "triangle", "square", "circle" };
+    std::vector<double> latencies(edits);
+    for (size_t i = 0; i < edits; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        if (i % 1000 == 999)
+            canvas->clearAll();
+        else if (i % 10 == 9)
+            canvas->removeLastShape();
+        else
+            canvas->addShape(names[i % 4]);
+        latencies[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+    for (int i = 0; i < 300; ++i) {
+        canvas->undo();
+    }
+    auto finishStart = std::chrono::steady_clock::now();
+    recording->finish();
+    std::chrono::duration<double, std::milli> finishTime = std::chrono::steady_clock::now() - finishStart;
+    std::sort(latencies.begin(), latencies.end());
+
+    auto loadStart = std::chrono::steady_clock::now();
+    SavedCanvasHistory *saved = new SavedCanvasHistory(path);
+    std::chrono::duration<double, std::milli> loadTime = std::chrono::steady_clock::now() - loadStart;
+
+    size_t mismatches = saved->size() == history->size() ? 0 : 1;
+    std::srand(5);
+    for (int i = 0; i < 1000 && mismatches == 0; ++i) {
+        size_t step = std::rand() % history->size();
+        CanvasMemento *restored = saved->restore(step);
+        if (!restored || restored->shapeIds() != history->restore(step)->shapeIds())
+            mismatches++;
+    }
+    struct stat info;
+    stat(path, &info);
+    int damaged = checkDamagedHistory(path);
+
+    std::cout << "\nSaving " << edits << " edits while editing:\n"
+              << "addShape p50 " << latencies[edits / 2] << " ns, p99 "
+              << latencies[edits * 99 / 100] << " ns\n"
+              << info.st_size / 1024 << " KiB on disk, " << finishTime.count() << " ms to finish, "
+              << loadTime.count() << " ms to load, " << mismatches << " mismatches, "
+              << damaged << " damaged files accepted\n";
+
+    delete saved;
+    delete canvas;
+    delete recording;
+    delete history;
+    unlink(path);
+}
+
+int main(int argc, char *argv[]) {
     CanvasHistory *history = new CanvasHistory;
     Canvas *canvas = new Canvas(history);
     
@@ -124,7 +1489,32 @@ int main() {
     std::cout << "Watching Replay:\n";
     ReplayCanvas *replayCanvas = new ReplayCanvas(history);
     replayCanvas->replay();
- 
+
+    DeltaCanvasHistory *deltaHistory = new DeltaCanvasHistory(2);
+    Canvas *deltaCanvas = new Canvas(deltaHistory);
+    deltaCanvas->addShape("rhombus");
+    deltaCanvas->addShape("triangle");
+    deltaCanvas->clearAll();
+    deltaCanvas->addShape("square");
+    deltaCanvas->addShape("circle");
+    deltaCanvas->removeLastShape();
+    deltaCanvas->undo();
+
+    std::cout << "Watching Replay of delta history:\n";
+    ReplayCanvas *deltaReplay = new ReplayCanvas(deltaHistory);
+    deltaReplay->replay();
+
+    std::cout << "Delta history backwards, every other step:\n";
+    deltaReplay->play(4, 0, 2);
+
+    benchmarkCheckpointInterval(argc > 1 ? std::atol(argv[1]) : 1000000);
+    benchmarkSpilling(argc > 1 ? std::atol(argv[1]) : 1000000);
+    benchmarkScrubbing(argc > 1 ? std::atol(argv[1]) : 1000000);
+    benchmarkSaving(argc > 1 ? std::atol(argv[1]) : 1000000);
+
+    delete deltaReplay;
+    delete deltaCanvas;
+    delete deltaHistory;
     return 0;
 }
 
@@ -3,6 +3,19 @@
 //
 
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
 
 class State {
 public:
@@ -62,23 +75,779 @@ public:
     }
 };
 
-    
-int main() {
+// The same state machine, data oriented: states and events are small
+// enums, transitions come from a table built at compile time, and
+// purchases live in a PurchaseTable as one byte of state each.
+
+enum PurchaseState : uint8_t {
+    Purchased,
+    InTransit,
+    Delivered,
+    Finished,       // past Delivered, where the State objects hand out nullptr
+    stateCount
+};
+
+enum PurchaseEvent : uint8_t {
+    NextState,      // what Purchase::gotoNextState does
+    Ship,
+    Deliver,
+    eventCount
+};
+
+struct Transition {
+    PurchaseState next;
+    bool valid;
+};
+
+typedef std::array<std::array<Transition, eventCount>, stateCount> TransitionTable;
+
+// Invalid transitions keep the current state and are marked as such.
+constexpr TransitionTable makeTransitionTable() {
+    TransitionTable table = {};
+    for (int s = 0; s < stateCount; ++s) {
+        for (int e = 0; e < eventCount; ++e) {
+            table[s][e] = Transition{ PurchaseState(s), false };
+        }
+    }
+    table[Purchased][NextState] = Transition{ InTransit, true };
+    table[InTransit][NextState] = Transition{ Delivered, true };
+    table[Delivered][NextState] = Transition{ Finished, true };
+    table[Purchased][Ship] = Transition{ InTransit, true };
+    table[InTransit][Deliver] = Transition{ Delivered, true };
+    return table;
+}
+
+constexpr TransitionTable transitions = makeTransitionTable();
+
+constexpr std::array<std::string_view, stateCount> stateDescriptions = {
+    "Current state: Purchased - Will be shipping soon\n",
+    "Current state: InTransit - Your item is on the way\n",
+    "Current state: Delivered - Your item has arrived\n",
+    "No more states!\n",
+};
+
+// Per event, the state each state moves to; the rows the bulk loops use.
+constexpr std::array<std::array<uint8_t, stateCount>, eventCount> makeNextStates() {
+    std::array<std::array<uint8_t, stateCount>, eventCount> next = {};
+    for (int e = 0; e < eventCount; ++e) {
+        for (int s = 0; s < stateCount; ++s) {
+            next[e][s] = transitions[s][e].next;
+        }
+    }
+    return next;
+}
+
+constexpr std::array<std::array<uint8_t, stateCount>, eventCount> nextStates = makeNextStates();
+
+// One entry of a batch such as a shipment manifest.
+struct PurchaseEventRecord {
+    uint32_t purchase;
+    PurchaseEvent event;
+};
+
+// What a batch of events did: accepted transitions by from/to state,
+// rejected events by state and event, and events naming no purchase or
+// no known event.
+struct TransitionStats {
+    std::array<std::array<uint64_t, stateCount>, stateCount> transitions = {};
+    std::array<std::array<uint64_t, eventCount>, stateCount> rejected = {};
+    uint64_t unknown = 0;
+
+    void merge(const TransitionStats &other) {
+        unknown += other.unknown;
+        for (int s = 0; s < stateCount; ++s) {
+            for (int t = 0; t < stateCount; ++t) {
+                transitions[s][t] += other.transitions[s][t];
+            }
+            for (int e = 0; e < eventCount; ++e) {
+                rejected[s][e] += other.rejected[s][e];
+            }
+        }
+    }
+    uint64_t accepted() const {
+        uint64_t total = 0;
+        for (auto &row : transitions) {
+            for (auto count : row) {
+                total += count;
+            }
+        }
+        return total;
+    }
+    uint64_t rejections() const {
+        uint64_t total = 0;
+        for (auto &row : rejected) {
+            for (auto count : row) {
+                total += count;
+            }
+        }
+        return total + unknown;
+    }
+};
+
+// One accepted transition in the audit trail.
+struct TransitionRecord {
+    uint32_t purchase;
+    uint8_t from;
+    uint8_t to;
+    uint16_t unused;
+    uint64_t timestamp;         // nanoseconds since the epoch
+};
+
+class PurchaseTable;
+
+/* Append-only audit trail of purchase transitions, plus snapshots.
+
+   log file        "PTLG", u32 version, then TransitionRecords back to back
+   snapshot file   "PTSN", u32 version, u64 log records covered,
+                   u64 purchase count, one state byte per purchase
+
+   Records are collected in memory and written in large batches. Every
+   `snapshotInterval` records a snapshot of the state array is written
+   next to the log, so recovery only replays the records after it.
+   A record with from == to is a purchase being added in that state.
+   Product names are not logged. Fixed-size fields are native-endian.
+   If the log can't be created or written, logging stops and good()
+   returns false.
+*/
+class TransitionLog {
+    std::string logPath;
+    std::string snapshotPath;
+    std::ofstream log;
+    std::vector<TransitionRecord> buffer;
+    uint64_t written = 0;               // records already in the file
+    uint64_t snapshotInterval;
+    uint64_t lastSnapshot = 0;
+    bool failed = false;
+    static constexpr size_t batchSize = 1 << 16;
+public:
+    static constexpr uint32_t version = 1;
+
+    TransitionLog(const std::string &logPath, const std::string &snapshotPath,
+                  uint64_t snapshotInterval = 10000000) :
+        logPath(logPath), snapshotPath(snapshotPath),
+        log(logPath, std::ios::binary | std::ios::trunc),
+        snapshotInterval(snapshotInterval) {
+        if (!log) {
+            std::cerr << "Can't create " << logPath << ", not logging\n";
+            failed = true;
+            return;
+        }
+        log.write("PTLG", 4);
+        log.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        buffer.reserve(batchSize);
+    }
+    ~TransitionLog() {
+        flush();
+    }
+    void append(const TransitionRecord &record) {
+        if (failed)
+            return;
+        buffer.push_back(record);
+        if (buffer.size() >= batchSize)
+            flush();
+    }
+    void append(const TransitionRecord *records, size_t count) {
+        if (failed)
+            return;
+        if (buffer.size() + count >= batchSize)
+            flush();
+        if (count >= batchSize) {
+            log.write(reinterpret_cast<const char*>(records), count * sizeof(TransitionRecord));
+            written += count;
+        } else {
+            buffer.insert(buffer.end(), records, records + count);
+        }
+    }
+    void flush() {
+        if (failed)
+            return;
+        log.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(TransitionRecord));
+        log.flush();
+        if (!log) {
+            std::cerr << "Can't write " << logPath << ", logging stopped\n";
+            failed = true;
+        }
+        written += buffer.size();
+        buffer.clear();
+    }
+    // false once the log couldn't be created or written
+    bool good() const {
+        return !failed;
+    }
+    uint64_t records() const {
+        return written + buffer.size();
+    }
+    // Writes a snapshot if `snapshotInterval` records went by since the last one.
+    void maybeSnapshot(const PurchaseTable &table) {
+        if (!failed && records() - lastSnapshot >= snapshotInterval)
+            snapshot(table);
+    }
+    void snapshot(const PurchaseTable &table);
+    // Rebuilds the states in `table` from a snapshot and the log records
+    // written after it. Returns the number of records replayed.
+    static uint64_t recover(PurchaseTable &table, const std::string &logPath,
+                            const std::string &snapshotPath);
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+};
+
+// Purchases as parallel arrays, indexed by purchase id.
+class PurchaseTable {
+    std::vector<std::string> productNames;
+    std::vector<uint8_t> states;
+    std::array<uint64_t, stateCount> stateCounts = {};
+    TransitionLog *log = nullptr;
+
+    // Applies events[begin, end) in order. Every event is a known event
+    // and targets a purchase that only this caller touches. Accepted transitions are written to
+    // `records`, which needs room for end - begin entries, if given.
+    size_t applyRange(const PurchaseEventRecord *events, size_t begin, size_t end,
+                      TransitionStats &stats, TransitionRecord *records, uint64_t timestamp) {
+        uint8_t *s = states.data();
+        size_t recorded = 0;
+        for (size_t i = begin; i < end; ++i) {
+            uint8_t &state = s[events[i].purchase];
+            Transition t = transitions[state][events[i].event];
+            // count both outcomes instead of branching on validity
+            stats.transitions[state][t.next] += t.valid;
+            stats.rejected[state][events[i].event] += !t.valid;
+            if (records) {
+                records[recorded] = TransitionRecord{ events[i].purchase, state, t.next, 0, timestamp };
+                recorded += t.valid;
+            }
+            state = t.next;
+        }
+        return recorded;
+    }
+    void recountStates() {
+        stateCounts = {};
+        for (uint8_t state : states) {
+            stateCounts[state]++;
+        }
+    }
+public:
+    size_t add(const std::string &productName, PurchaseState initialState = Purchased) {
+        productNames.push_back(productName);
+        states.push_back(initialState);
+        stateCounts[initialState]++;
+        size_t id = states.size() - 1;
+        if (log) {
+            log->append(TransitionRecord{ uint32_t(id), uint8_t(initialState), uint8_t(initialState),
+                                          0, TransitionLog::now() });
+            log->maybeSnapshot(*this);
+        }
+        return id;
+    }
+    void reserve(size_t count) {
+        productNames.reserve(count);
+        states.reserve(count);
+    }
+    size_t size() const {
+        return states.size();
+    }
+    PurchaseState state(size_t id) const {
+        return PurchaseState(states[id]);
+    }
+    const std::string &productName(size_t id) const {
+        return productNames[id];
+    }
+    std::string_view getDescription(size_t id) const {
+        return stateDescriptions[states[id]];
+    }
+    // Returns false, leaving the state alone, if `event` doesn't apply or
+    // `id` and `event` aren't known.
+    bool apply(size_t id, PurchaseEvent event) {
+        if (id >= states.size() || event >= eventCount)
+            return false;
+        uint8_t from = states[id];
+        Transition t = transitions[from][event];
+        stateCounts[from]--;
+        stateCounts[t.next]++;
+        states[id] = t.next;
+        // the snapshot must already include this transition
+        if (log && t.valid) {
+            log->append(TransitionRecord{ uint32_t(id), from, t.next, 0, TransitionLog::now() });
+            log->maybeSnapshot(*this);
+        }
+        return t.valid;
+    }
+    // Every added purchase and accepted transition from now on goes to
+    // `log`; nullptr stops it. Purchases already in the table are covered
+    // by a snapshot taken here.
+    void setLog(TransitionLog *newLog) {
+        log = newLog;
+        if (log && !states.empty())
+            log->snapshot(*this);
+    }
+    const uint8_t *stateData() const {
+        return states.data();
+    }
+    // Replaces all states, e.g. after recovery. Purchases beyond the
+    // current size are added without a product name.
+    void loadStates(const uint8_t *data, size_t count) {
+        states.assign(data, data + count);
+        productNames.resize(count);
+        recountStates();
+    }
+    void setState(size_t id, PurchaseState state) {
+        states[id] = state;
+    }
+    // number of purchases currently in `state`
+    uint64_t count(PurchaseState state) const {
+        return stateCounts[state];
+    }
+    void gotoNextState(size_t id) {
+        apply(id, NextState);
+    }
+    // Applies `event` to every purchase: a byte lookup per purchase with
+    // no branches, which the compiler is free to unroll and vectorize.
+    void applyToAll(PurchaseEvent event) {
+        if (event >= eventCount)
+            return;
+        const uint8_t *next = nextStates[event].data();
+        uint8_t *s = states.data();
+        size_t count = states.size();
+        if (log) {
+            uint64_t timestamp = TransitionLog::now();
+            for (size_t i = 0; i < count; ++i) {
+                if (transitions[s[i]][event].valid)
+                    log->append(TransitionRecord{ uint32_t(i), s[i], next[s[i]], 0, timestamp });
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            s[i] = next[s[i]];
+        }
+        std::array<uint64_t, stateCount> counts = {};
+        for (int state = 0; state < stateCount; ++state) {
+            counts[next[state]] += stateCounts[state];
+        }
+        stateCounts = counts;
+        if (log)
+            log->maybeSnapshot(*this);
+    }
+    void advanceAll() {
+        applyToAll(NextState);
+    }
+
+    // Applies a batch of events on `threadCount` threads. Purchase ids are
+    // split into one contiguous range per thread; the events are first
+    // bucketed by range, keeping their order, then each thread applies its
+    // own bucket. Threads share no state until their stats are merged.
+    // Events for ids past size(), or with no known event, are rejected and
+    // counted as unknown.
+    TransitionStats applyEvents(const std::vector<PurchaseEventRecord> &events,
+                                unsigned threadCount) {
+        if (states.empty()) {
+            TransitionStats none;
+            none.unknown = events.size();
+            return none;
+        }
+        unsigned threads = std::max(1u, threadCount);
+        size_t purchaseCount = states.size();
+        size_t purchasesPerThread = (purchaseCount + threads - 1) / threads;
+        size_t eventsPerThread = (events.size() + threads - 1) / threads;
+        auto ownerOf = [purchasesPerThread](uint32_t purchase) {
+            return purchase / purchasesPerThread;
+        };
+        auto isKnown = [purchaseCount](const PurchaseEventRecord &record) {
+            return record.purchase < purchaseCount && record.event < eventCount;
+        };
+        auto runOnThreads = [threads](auto work) {
+            std::vector<std::thread> pool;
+            for (unsigned t = 1; t < threads; ++t) {
+                pool.emplace_back(work, t);
+            }
+            work(0);
+            for (auto &thread : pool) {
+                thread.join();
+            }
+        };
+
+        // counts[chunk][owner]: events in chunk `chunk` for thread `owner`
+        std::vector<std::vector<size_t>> counts(threads, std::vector<size_t>(threads, 0));
+        std::vector<TransitionStats> stats(threads);
+        runOnThreads([&](unsigned chunk) {
+            size_t end = std::min(events.size(), (chunk + 1) * eventsPerThread);
+            for (size_t i = chunk * eventsPerThread; i < end; ++i) {
+                if (isKnown(events[i]))
+                    counts[chunk][ownerOf(events[i].purchase)]++;
+                else
+                    stats[chunk].unknown++;
+            }
+        });
+        // turn counts into write positions: owner-major, then chunk order
+        std::vector<size_t> bucketStart(threads + 1, 0);
+        size_t position = 0;
+        for (unsigned owner = 0; owner < threads; ++owner) {
+            bucketStart[owner] = position;
+            for (unsigned chunk = 0; chunk < threads; ++chunk) {
+                size_t count = counts[chunk][owner];
+                counts[chunk][owner] = position;
+                position += count;
+            }
+        }
+        bucketStart[threads] = position;
+
+        std::vector<PurchaseEventRecord> bucketed(position);
+        runOnThreads([&](unsigned chunk) {
+            std::vector<size_t> &next = counts[chunk];
+            size_t end = std::min(events.size(), (chunk + 1) * eventsPerThread);
+            for (size_t i = chunk * eventsPerThread; i < end; ++i) {
+                if (isKnown(events[i]))
+                    bucketed[next[ownerOf(events[i].purchase)]++] = events[i];
+            }
+        });
+
+        // with a log, accepted transitions are gathered in place of the
+        // bucketed events and appended in owner order afterwards
+        std::vector<TransitionRecord> records(log ? position : 0);
+        std::vector<size_t> recorded(threads, 0);
+        uint64_t timestamp = TransitionLog::now();
+        runOnThreads([&](unsigned owner) {
+            recorded[owner] = applyRange(bucketed.data(), bucketStart[owner], bucketStart[owner + 1],
+                                         stats[owner], log ? records.data() + bucketStart[owner] : nullptr,
+                                         timestamp);
+        });
+        if (log) {
+            for (unsigned owner = 0; owner < threads; ++owner) {
+                log->append(records.data() + bucketStart[owner], recorded[owner]);
+            }
+        }
+
+        TransitionStats total;
+        for (auto &threadStats : stats) {
+            total.merge(threadStats);
+        }
+        for (int from = 0; from < stateCount; ++from) {
+            for (int to = 0; to < stateCount; ++to) {
+                stateCounts[from] -= total.transitions[from][to];
+                stateCounts[to] += total.transitions[from][to];
+            }
+        }
+        if (log)
+            log->maybeSnapshot(*this);
+        return total;
+    }
+};
+
+void TransitionLog::snapshot(const PurchaseTable &table) {
+    flush();
+    if (failed)
+        return;
+    // write next to the old snapshot and swap it in, so a crash midway
+    // leaves the previous snapshot intact
+    std::string temporary = snapshotPath + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    uint64_t count = table.size();
+    out.write("PTSN", 4);
+    out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    out.write(reinterpret_cast<const char*>(&written), sizeof(written));
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(table.stateData()), count);
+    out.close();
+    if (!out || std::rename(temporary.c_str(), snapshotPath.c_str()) != 0) {
+        std::cerr << "Can't write snapshot " << snapshotPath << "\n";
+        return;
+    }
+    lastSnapshot = written;
+}
+
+uint64_t TransitionLog::recover(PurchaseTable &table, const std::string &logPath,
+                                const std::string &snapshotPath) {
+    uint64_t covered = 0;
+    std::ifstream snapshot(snapshotPath, std::ios::binary);
+    if (snapshot) {
+        char magic[4];
+        uint32_t snapshotVersion = 0;
+        uint64_t count = 0;
+        snapshot.read(magic, 4);
+        snapshot.read(reinterpret_cast<char*>(&snapshotVersion), sizeof(snapshotVersion));
+        snapshot.read(reinterpret_cast<char*>(&covered), sizeof(covered));
+        snapshot.read(reinterpret_cast<char*>(&count), sizeof(count));
+        std::vector<uint8_t> states(count);
+        snapshot.read(reinterpret_cast<char*>(states.data()), count);
+        if (!snapshot || std::memcmp(magic, "PTSN", 4) != 0 || snapshotVersion != version) {
+            std::cerr << snapshotPath << " is not a purchase snapshot, replaying the whole log\n";
+            covered = 0;
+        } else {
+            table.loadStates(states.data(), count);
+        }
+    }
+
+    std::ifstream in(logPath, std::ios::binary);
+    char magic[4];
+    uint32_t logVersion = 0;
+    in.read(magic, 4);
+    in.read(reinterpret_cast<char*>(&logVersion), sizeof(logVersion));
+    if (!in || std::memcmp(magic, "PTLG", 4) != 0 || logVersion != version) {
+        std::cerr << logPath << " is not a transition log\n";
+        return 0;
+    }
+    in.seekg(covered * sizeof(TransitionRecord), std::ios::cur);
+
+    // replay into a local copy, growing it as new ids show up, and hand
+    // the result to the table once
+    std::vector<uint8_t> states(table.stateData(), table.stateData() + table.size());
+    uint64_t replayed = 0;
+    std::vector<TransitionRecord> batch(batchSize);
+    while (in) {
+        in.read(reinterpret_cast<char*>(batch.data()), batch.size() * sizeof(TransitionRecord));
+        size_t count = in.gcount() / sizeof(TransitionRecord);
+        for (size_t i = 0; i < count; ++i) {
+            size_t purchase = batch[i].purchase;
+            if (purchase >= states.size()) {
+                if (purchase >= states.capacity())
+                    states.reserve(std::max(purchase + 1, 2 * states.capacity()));
+                states.resize(purchase + 1, Purchased);
+            }
+            states[purchase] = batch[i].to;
+        }
+        replayed += count;
+    }
+    table.loadStates(states.data(), states.size());
+    return replayed;
+}
+
+// Creates an empty file with a unique name under /tmp. Returns "" if that fails.
+std::string temporaryFile(const std::string &prefix) {
+    std::string path = "/tmp/" + prefix + "XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        std::cerr << "Can't create a temporary file\n";
+        return "";
+    }
+    close(fd);
+    return path;
+}
+
+// A snapshot taken by the transition that reaches the interval must
+// include that transition, and purchases added after it must come back.
+// advanceAll() snapshots too, and a log that can't be created says so.
+bool checkSnapshotOnTransition() {
+    std::string logPath = temporaryFile("purchases-log");
+    std::string snapshotPath = temporaryFile("purchases-snapshot");
+    if (logPath.empty() || snapshotPath.empty())
+        return false;
+    std::remove(snapshotPath.c_str());
+
+    PurchaseTable live;
+    live.add("Shoes");
+    live.add("Hat");
+    {
+        TransitionLog log(logPath, snapshotPath, 1);
+        live.setLog(&log);
+        live.apply(0, Ship);            // snapshots right on this transition
+        live.add("Scarf");              // snapshots again, then never transitions
+        live.apply(1, Ship);
+        live.setLog(nullptr);
+    }
+    PurchaseTable recovered;
+    TransitionLog::recover(recovered, logPath, snapshotPath);
+    bool same = recovered.size() == live.size() &&
+                std::memcmp(recovered.stateData(), live.stateData(), live.size()) == 0;
+    std::cout << "Snapshot on a transition: recovered " << recovered.size() << " purchases, "
+              << (same ? "states match" : "STATES DIFFER") << "\n";
+
+    uint64_t replayed;
+    {
+        TransitionLog log(logPath, snapshotPath, 1);
+        live.setLog(&log);
+        live.advanceAll();
+        live.setLog(nullptr);
+    }
+    PurchaseTable advanced;
+    replayed = TransitionLog::recover(advanced, logPath, snapshotPath);
+    bool snapshotted = replayed == 0 && advanced.size() == live.size() &&
+                       std::memcmp(advanced.stateData(), live.stateData(), live.size()) == 0;
+    std::cout << "Snapshot after advanceAll: " << replayed << " records replayed, "
+              << (snapshotted ? "states match" : "STATES DIFFER") << "\n";
+    std::remove(logPath.c_str());
+    std::remove(snapshotPath.c_str());
+
+    TransitionLog unwritable(logPath + ".missing/log", snapshotPath + ".missing/snapshot");
+    live.setLog(&unwritable);
+    live.advanceAll();
+    live.setLog(nullptr);
+    return same && snapshotted && !unwritable.good();
+}
+
+// purchases/sec for advancing every purchase one state, objects vs table
+void benchmarkAdvance(size_t count) {
+    DeliveredState deliveredState(nullptr);
+    InTransitState inTransitState(&deliveredState);
+    PurchasedState purchasedState(&inTransitState);
+
+    std::vector<Purchase*> purchases;
+    purchases.reserve(count);
+    PurchaseTable table;
+    table.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        purchases.push_back(new Purchase("Shoes", &purchasedState));
+        table.add("Shoes");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < 2; ++round) {
+        for (auto purchase : purchases) {
+            purchase->gotoNextState();
+        }
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (int round = 0; round < 2; ++round) {
+        table.advanceAll();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::chrono::duration<double> objects = middle - start;
+    std::chrono::duration<double> data = end - middle;
+    std::cout << "Advancing " << count << " purchases twice:\n"
+              << "State objects:  " << 2 * count / objects.count() << " purchases/sec\n"
+              << "PurchaseTable:  " << 2 * count / data.count() << " purchases/sec\n"
+              << "first purchase is now " << purchases[0]->getDescription()
+              << "first table row is now " << table.getDescription(0);
+
+    for (auto purchase : purchases) {
+        delete purchase;
+    }
+}
+
+// events/sec for applyEvents from one thread up to every hardware thread
+void benchmarkBulkEvents(size_t purchases, size_t eventCount) {
+    std::vector<PurchaseEventRecord> events(eventCount);
+    std::srand(17);
+    for (auto &event : events) {
+        event.purchase = std::rand() % purchases;
+        event.event = PurchaseEvent(std::rand() % 3);
+    }
+    unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> threadCounts;
+    for (unsigned threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    std::cout << "\nApplying " << eventCount << " events to " << purchases << " purchases:\n";
+    for (unsigned threads : threadCounts) {
+        PurchaseTable table;
+        table.reserve(purchases);
+        for (size_t i = 0; i < purchases; ++i) {
+            table.add("Shoes");
+        }
+        auto start = std::chrono::steady_clock::now();
+        TransitionStats stats = table.applyEvents(events, threads);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << threads << " threads: " << eventCount / elapsed.count() << " events/sec ("
+                  << stats.accepted() << " accepted, " << stats.rejections() << " rejected, "
+                  << table.count(Delivered) << " delivered)\n";
+    }
+}
+
+// Log write throughput, then recovery from the last snapshot plus the tail.
+// Returns false if the recovered states differ.
+bool benchmarkTransitionLog(size_t purchases, size_t eventCount) {
+    std::string logPath = temporaryFile("purchases-log");
+    std::string snapshotPath = temporaryFile("purchases-snapshot");
+    if (logPath.empty() || snapshotPath.empty())
+        return false;
+    std::vector<PurchaseEventRecord> events(eventCount);
+    std::srand(23);
+    for (auto &event : events) {
+        event.purchase = std::rand() % purchases;
+        event.event = PurchaseEvent(std::rand() % 3);
+    }
+
+    PurchaseTable table;
+    table.reserve(purchases);
+    for (size_t i = 0; i < purchases; ++i) {
+        table.add("Shoes");
+    }
+    uint64_t logged;
+    auto start = std::chrono::steady_clock::now();
+    {
+        TransitionLog log(logPath, snapshotPath, eventCount / 4);
+        table.setLog(&log);
+        // arrives as ten manifests, so snapshots land between them
+        size_t per = (eventCount + 9) / 10;
+        for (size_t first = 0; first < eventCount; first += per) {
+            std::vector<PurchaseEventRecord> manifest(events.begin() + first,
+                                                      events.begin() + std::min(eventCount, first + per));
+            table.applyEvents(manifest, std::thread::hardware_concurrency());
+        }
+        table.setLog(nullptr);
+        logged = log.records();
+    }
+    std::chrono::duration<double> writing = std::chrono::steady_clock::now() - start;
+
+    PurchaseTable recovered;
+    start = std::chrono::steady_clock::now();
+    uint64_t replayed = TransitionLog::recover(recovered, logPath, snapshotPath);
+    std::chrono::duration<double, std::milli> recovering = std::chrono::steady_clock::now() - start;
+
+    bool same = recovered.size() == table.size() &&
+                std::memcmp(recovered.stateData(), table.stateData(), table.size()) == 0;
+    std::cout << "\nLogging " << eventCount << " events (" << logged << " transitions): "
+              << eventCount / writing.count() << " events/sec, "
+              << logged / writing.count() << " transitions/sec, "
+              << logged * sizeof(TransitionRecord) / writing.count() / (1 << 20) << " MiB/sec\n"
+              << "Recovery replayed " << replayed << " records in " << recovering.count() << " ms, "
+              << (same ? "states match" : "STATES DIFFER") << "\n";
+    std::remove(logPath.c_str());
+    std::remove(snapshotPath.c_str());
+    return same;
+}
+
+int main(int argc, char *argv[]) {
     DeliveredState *deliveredState = new DeliveredState(nullptr);
     InTransitState *inTransitState = new InTransitState(deliveredState);
     PurchasedState *purchasedState = new PurchasedState(inTransitState);
-    
+
     Purchase *purchase = new Purchase("Shoes", purchasedState);
     std::cout << purchase->getDescription() << "\n";
     purchase->gotoNextState();
     std::cout << purchase->getDescription() << "\n";
     purchase->gotoNextState();
     std::cout << purchase->getDescription() << "\n";
-    
+
+    PurchaseTable table;
+    size_t shoes = table.add("Shoes");
+    std::cout << table.getDescription(shoes) << "\n";
+    table.gotoNextState(shoes);
+    std::cout << table.getDescription(shoes) << "\n";
+    if (!table.apply(shoes, Ship))
+        std::cout << "Can't ship " << table.productName(shoes) << " again\n";
+    table.apply(shoes, Deliver);
+    std::cout << table.getDescription(shoes) << "\n";
+
+    std::vector<PurchaseEventRecord> manifest = {
+        { 0, Ship }, { 1, Ship }, { 0, Deliver }, { 2, Deliver }, { 1, Ship }, { 7, Ship },
+        { 2, PurchaseEvent(200) },
+    };
+    PurchaseTable orders;
+    orders.add("Shoes");
+    orders.add("Hat");
+    orders.add("Scarf");
+    TransitionStats stats = orders.applyEvents(manifest, 2);
+    std::cout << "Manifest: " << stats.accepted() << " accepted, "
+              << stats.rejections() << " rejected (" << stats.unknown << " unknown); "
+              << orders.count(Purchased) << " purchased, "
+              << orders.count(InTransit) << " in transit, "
+              << orders.count(Delivered) << " delivered\n";
+    PurchaseTable empty;
+    std::cout << "Empty table: " << empty.applyEvents(manifest, 2).unknown << " of "
+              << manifest.size() << " events unknown\n";
+    bool recovered = checkSnapshotOnTransition();
+    std::cout << "\n";
+
+    size_t count = argc > 1 ? std::atol(argv[1]) : 10000000;
+    benchmarkAdvance(count);
+    benchmarkBulkEvents(count, 2 * count);
+    recovered = benchmarkTransitionLog(count, argc > 2 ? std::atol(argv[2]) : 2 * count) && recovered;
+
     delete(deliveredState);
     delete(inTransitState);
     delete(purchasedState);
     delete(purchase);
-    return 0;
+    return recovered ? 0 : 1;
 }
-
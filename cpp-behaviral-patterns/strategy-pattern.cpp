@@ -3,30 +3,97 @@
 //
 
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <algorithm>
+#include <variant>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
 
 class GreetingStrategy {
 public:
     virtual void greet(const std::string & name) = 0;
+    // A greeting that is just `prefix + name + suffix` reports the two
+    // parts here, which lets greetAll format without calling greet.
+    virtual bool greetingParts(std::string_view & /*prefix*/, std::string_view & /*suffix*/) const {
+        return false;
+    }
+    // Greets everyone in `names`. With fixed greeting parts, greetings are
+    // copied into a buffer sized exactly for the batch and written with one
+    // call per batch; otherwise this falls back to greet(). Batches are
+    // capped so the buffer is reused while it is still in cache.
+    virtual void greetAll(const std::vector<std::string> &names) {
+        std::string_view prefix, suffix;
+        if (!greetingParts(prefix, suffix)) {
+            for (auto &name : names) {
+                greet(name);
+            }
+            return;
+        }
+        const size_t batchSize = 4096;
+        std::string buffer;
+        for (size_t first = 0; first < names.size(); first += batchSize) {
+            size_t last = std::min(names.size(), first + batchSize);
+            size_t size = (last - first) * (prefix.size() + suffix.size());
+            for (size_t i = first; i < last; ++i) {
+                size += names[i].size();
+            }
+            buffer.resize(size);
+            char *out = &buffer[0];
+            for (size_t i = first; i < last; ++i) {
+                std::memcpy(out, prefix.data(), prefix.size());
+                out += prefix.size();
+                std::memcpy(out, names[i].data(), names[i].size());
+                out += names[i].size();
+                std::memcpy(out, suffix.data(), suffix.size());
+                out += suffix.size();
+            }
+            std::cout.write(buffer.data(), buffer.size());
+        }
+    }
+};
+
+// A strategy whose greeting is just `prefix + name + suffix`. Subclasses
+// only report the two parts; greet() and greetAll() both format from them.
+class FixedGreetingStrategy : public GreetingStrategy {
+public:
+    void greet(const std::string & name) override {
+        std::string_view prefix, suffix;
+        if (!greetingParts(prefix, suffix)) {
+            std::cerr << "Greeting strategy has no greeting parts" << std::endl;
+            return;
+        }
+        std::cout << prefix << name << suffix;
+    }
+    bool greetingParts(std::string_view &prefix, std::string_view &suffix) const override = 0;
 };
 
-class NormalGreetingStrategy : public GreetingStrategy {
+class NormalGreetingStrategy : public FixedGreetingStrategy {
 public:
-    void greet(const std::string & name) {
-        std::cout << "Hi " << name << ", how are you?\n";
+    bool greetingParts(std::string_view &prefix, std::string_view &suffix) const override {
+        prefix = "Hi ";
+        suffix = ", how are you?\n";
+        return true;
     }
 };
 
-class FormalGreetingStrategy : public GreetingStrategy {
+class FormalGreetingStrategy : public FixedGreetingStrategy {
 public:
-    void greet(const std::string & name) {
-        std::cout << "Good morning " << name << ", how do you do?\n";
+    bool greetingParts(std::string_view &prefix, std::string_view &suffix) const override {
+        prefix = "Good morning ";
+        suffix = ", how do you do?\n";
+        return true;
     }
 };
 
-class InformalGreetingStrategy : public GreetingStrategy {
+class InformalGreetingStrategy : public FixedGreetingStrategy {
 public:
-    void greet(const std::string & name) {
-        std::cout << "Hey " << name << ", what's up?\n";
+    bool greetingParts(std::string_view &prefix, std::string_view &suffix) const override {
+        prefix = "Hey ";
+        suffix = ", what's up?\n";
+        return true;
     }
 };
 
@@ -40,9 +107,158 @@ public:
     void greet(const std::string &name) {
         greetingStrategy->greet(name);
     }
+    void greetAll(const std::vector<std::string> &names) {
+        greetingStrategy->greetAll(names);
+    }
+};
+
+// The same Person with the strategy stored inline instead of behind a
+// pointer. Both know the exact strategy type at the call, so greet() is a
+// direct call the compiler can inline, and there is no allocation. The
+// strategies still derive from the polymorphic GreetingStrategy, so each
+// stored strategy still carries a vptr; only the calls skip it.
+
+// strategy fixed at compile time
+template<typename Strategy>
+class StaticPerson {
+    Strategy greetingStrategy;
+public:
+    void greet(const std::string &name) {
+        greetingStrategy.greet(name);
+    }
+};
+
+// strategy picked at run time from a closed set
+typedef std::variant<NormalGreetingStrategy, FormalGreetingStrategy,
+                     InformalGreetingStrategy> AnyGreetingStrategy;
+
+class VariantPerson {
+    AnyGreetingStrategy greetingStrategy;
+public:
+    VariantPerson(AnyGreetingStrategy greetingStrategy) : greetingStrategy(greetingStrategy) {}
+    void greet(const std::string &name) {
+        std::visit([&name](auto &strategy) { strategy.greet(name); }, greetingStrategy);
+    }
+};
+
+// Swallows whatever is written to it, so the benchmark measures dispatch
+// and formatting rather than the terminal.
+class NullBuffer : public std::streambuf {
+    char buffer[4096];
+protected:
+    int overflow(int c) override {
+        setp(buffer, buffer + sizeof(buffer));
+        return c;
+    }
 };
 
-int main() {
+// greetings/sec for virtual, variant and template dispatch over a mixed
+// population, greeting everyone `rounds` times
+void benchmarkDispatch(size_t people, int rounds) {
+    std::vector<Person*> virtualPeople;
+    std::vector<VariantPerson> variantPeople;
+    // the template version needs the type statically, so the same
+    // population is grouped by strategy
+    std::vector<StaticPerson<NormalGreetingStrategy>> normalPeople;
+    std::vector<StaticPerson<FormalGreetingStrategy>> formalPeople;
+    std::vector<StaticPerson<InformalGreetingStrategy>> informalPeople;
+    virtualPeople.reserve(people);
+    variantPeople.reserve(people);
+    for (size_t i = 0; i < people; ++i) {
+        switch (i % 3) {
+        case 0:
+            virtualPeople.push_back(new Person(new NormalGreetingStrategy()));
+            variantPeople.push_back(VariantPerson(NormalGreetingStrategy()));
+            normalPeople.emplace_back();
+            break;
+        case 1:
+            virtualPeople.push_back(new Person(new FormalGreetingStrategy()));
+            variantPeople.push_back(VariantPerson(FormalGreetingStrategy()));
+            formalPeople.emplace_back();
+            break;
+        default:
+            virtualPeople.push_back(new Person(new InformalGreetingStrategy()));
+            variantPeople.push_back(VariantPerson(InformalGreetingStrategy()));
+            informalPeople.emplace_back();
+            break;
+        }
+    }
+
+    NullBuffer sink;
+    std::streambuf *terminal = std::cout.rdbuf(&sink);
+    const std::string name = "Anand";
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (auto person : virtualPeople) {
+            person->greet(name);
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (auto &person : variantPeople) {
+            person.greet(name);
+        }
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (auto &person : normalPeople) {
+            person.greet(name);
+        }
+        for (auto &person : formalPeople) {
+            person.greet(name);
+        }
+        for (auto &person : informalPeople) {
+            person.greet(name);
+        }
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    std::cout.rdbuf(terminal);
+
+    double greetings = double(people) * rounds;
+    auto rate = [greetings](std::chrono::steady_clock::duration d) {
+        return greetings / std::chrono::duration<double>(d).count();
+    };
+    std::cout << "\nGreeting " << people << " people " << rounds << " times:\n"
+              << "virtual:  " << rate(t1 - t0) << " greetings/sec\n"
+              << "variant:  " << rate(t2 - t1) << " greetings/sec\n"
+              << "template: " << rate(t3 - t2) << " greetings/sec\n";
+
+    for (auto person : virtualPeople) {
+        delete person;
+    }
+}
+
+// greetings/sec for one greet() call per name versus greetAll()
+void benchmarkGreetAll(size_t count) {
+    std::vector<std::string> names;
+    names.reserve(count);
+    const char *sample[] = { "Anand", "Sashwin", "Meenu", "Ashwad", "Bob" };
+    for (size_t i = 0; i < count; ++i) {
+        names.push_back(sample[i % 5]);
+    }
+    FormalGreetingStrategy formal;
+
+    NullBuffer sink;
+    std::streambuf *terminal = std::cout.rdbuf(&sink);
+    auto t0 = std::chrono::steady_clock::now();
+    for (auto &name : names) {
+        formal.greet(name);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    formal.greetAll(names);
+    auto t2 = std::chrono::steady_clock::now();
+    std::cout.rdbuf(terminal);
+
+    auto rate = [count](std::chrono::steady_clock::duration d) {
+        return count / std::chrono::duration<double>(d).count();
+    };
+    std::cout << "\nGreeting " << count << " names:\n"
+              << "greet() per name: " << rate(t1 - t0) << " greetings/sec\n"
+              << "greetAll():       " << rate(t2 - t1) << " greetings/sec\n";
+}
+
+int main(int argc, char *argv[]) {
     Person businessPerson(new FormalGreetingStrategy());
     Person normalPerson(new NormalGreetingStrategy());
     Person coolPerson(new InformalGreetingStrategy());
@@ -55,5 +271,18 @@ int main() {
     coolPerson.greet("Anand");
     std::cout << "The politician says: ";
     politician.greet("Anand");
+
+    StaticPerson<FormalGreetingStrategy> staticBusinessPerson;
+    VariantPerson variantCoolPerson(InformalGreetingStrategy{});
+    std::cout << "The compile-time businessperson says: ";
+    staticBusinessPerson.greet("Sashwin");
+    std::cout << "The variant cool person says: ";
+    variantCoolPerson.greet("Anand");
+
+    std::cout << "The normal person greets everyone: ";
+    normalPerson.greetAll({ "Anand", "Sashwin", "Meenu" });
+
+    benchmarkDispatch(argc > 1 ? std::atol(argv[1]) : 1000000, 10);
+    benchmarkGreetAll(argc > 1 ? 10 * std::atol(argv[1]) : 10000000);
     return 0;
 }
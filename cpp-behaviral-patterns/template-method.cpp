@@ -5,6 +5,16 @@
 //
 
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <cstring>
+#include <chrono>
+#include <cstdlib>
+#include <cctype>
+
+class CompiledGreetingCard;
 
 class GreetingCardTemplate {
 protected:
@@ -17,17 +27,168 @@ protected:
     virtual std::string closing(const std::string &from) {
         return "Sincerely,\n" + from + "\n";
     }
+    // True only if intro() and closing() paste the names in verbatim and
+    // nothing else depends on them, which lets compile() precompute the
+    // text around them. Subclasses inherit the answer, so compile() also
+    // checks it before trusting it.
+    virtual bool pastesNames() const {
+        return false;
+    }
 public:
     std::string generate(const std::string &to, const std::string &from) {
         return intro(to) + occasion() + closing(from);
     }
+    CompiledGreetingCard compile();
+};
+
+// Bump allocator for rendered cards; reset() reuses the memory for the
+// next run of cards.
+class CardArena {
+    std::vector<char> storage;
+    size_t used = 0;
+public:
+    CardArena(size_t capacity) : storage(capacity) {}
+    // nullptr when the arena is full
+    char *allocate(size_t size) {
+        if (storage.size() - used < size)
+            return nullptr;
+        char *p = storage.data() + used;
+        used += size;
+        return p;
+    }
+    void reset() {
+        used = 0;
+    }
 };
 
+// A card template reduced to literal text and the places where the
+// recipient and sender go. The literals are worked out once by
+// GreetingCardTemplate::compile, through the template's own (possibly
+// overridden) intro/occasion/closing, and reused for every card.
+class CompiledGreetingCard {
+public:
+    enum Slot { NoSlot, To, From };
+private:
+    struct Piece {
+        std::string literal;
+        Slot slot;                      // filled in after the literal
+    };
+    std::vector<Piece> pieces;
+    size_t literalSize = 0;
+    GreetingCardTemplate *fallback;     // used when the template didn't compile
+
+    size_t slotSize(Slot slot, const std::string &to, const std::string &from) const {
+        return slot == To ? to.size() : slot == From ? from.size() : 0;
+    }
+public:
+    CompiledGreetingCard(GreetingCardTemplate *fallback) : fallback(fallback) {}
+    void addPiece(std::string literal, Slot slot) {
+        literalSize += literal.size();
+        pieces.push_back(Piece{ std::move(literal), slot });
+    }
+    bool isCompiled() const {
+        return fallback == nullptr;
+    }
+    size_t sizeFor(const std::string &to, const std::string &from) const {
+        size_t size = literalSize;
+        for (auto &piece : pieces) {
+            size += slotSize(piece.slot, to, from);
+        }
+        return size;
+    }
+    // Writes the card to `out`, which needs sizeFor(to, from) bytes.
+    void renderTo(char *out, const std::string &to, const std::string &from) const {
+        for (auto &piece : pieces) {
+            std::memcpy(out, piece.literal.data(), piece.literal.size());
+            out += piece.literal.size();
+            if (piece.slot == To) {
+                std::memcpy(out, to.data(), to.size());
+                out += to.size();
+            } else if (piece.slot == From) {
+                std::memcpy(out, from.data(), from.size());
+                out += from.size();
+            }
+        }
+    }
+    // One allocation, of exactly the card's size.
+    std::string render(const std::string &to, const std::string &from) const {
+        if (!isCompiled())
+            return fallback->generate(to, from);
+        std::string card(sizeFor(to, from), '\0');
+        renderTo(&card[0], to, from);
+        return card;
+    }
+    // The card lives in `arena` until it is reset. A compiled card doesn't
+    // allocate; the generate() fallback builds a std::string first and
+    // copies it in. Returns an empty view when the arena is full.
+    std::string_view render(const std::string &to, const std::string &from, CardArena &arena) const {
+        std::string generated;
+        if (!isCompiled())
+            generated = fallback->generate(to, from);
+        size_t size = isCompiled() ? sizeFor(to, from) : generated.size();
+        char *out = arena.allocate(size);
+        if (!out)
+            return std::string_view();
+        if (isCompiled())
+            renderTo(out, to, from);
+        else
+            std::memcpy(out, generated.data(), size);
+        return std::string_view(out, size);
+    }
+};
+
+// Generates the card with `toMarker` and `fromMarker` as the names and
+// splits it into the literal text before each marker and the slot it
+// marks. The last piece has NoSlot.
+static std::vector<std::pair<std::string, CompiledGreetingCard::Slot>>
+splitProbe(const std::string &probe, const std::string &toMarker, const std::string &fromMarker) {
+    std::vector<std::pair<std::string, CompiledGreetingCard::Slot>> pieces;
+    size_t start = 0;
+    for (;;) {
+        size_t to = probe.find(toMarker, start);
+        size_t from = probe.find(fromMarker, start);
+        if (to == std::string::npos && from == std::string::npos)
+            break;
+        bool isTo = to < from;
+        size_t at = isTo ? to : from;
+        pieces.emplace_back(probe.substr(start, at - start),
+                            isTo ? CompiledGreetingCard::To : CompiledGreetingCard::From);
+        start = at + (isTo ? toMarker : fromMarker).size();
+    }
+    pieces.emplace_back(probe.substr(start), CompiledGreetingCard::NoSlot);
+    return pieces;
+}
+
+// For a template that pastesNames(), generates the card twice with two
+// different pairs of marker names and splits out the literal text around
+// them. The markers are words, so a template that changes the names
+// (case, length, spelling) splits differently on the two probes; unless
+// both give the same pieces, the template renders through generate().
+CompiledGreetingCard GreetingCardTemplate::compile() {
+    if (!pastesNames())
+        return CompiledGreetingCard(this);
+    const std::string to1 = "\x01to\x01", from1 = "\x02from\x02";
+    const std::string to2 = "\x03recipient\x03", from2 = "\x04sender\x04";
+    auto first = splitProbe(generate(to1, from1), to1, from1);
+    auto second = splitProbe(generate(to2, from2), to2, from2);
+    if (first != second)
+        return CompiledGreetingCard(this);
+
+    CompiledGreetingCard compiled(nullptr);
+    for (auto &piece : first) {
+        compiled.addPiece(std::move(piece.first), piece.second);
+    }
+    return compiled;
+}
+
 class BirthdayCardTemplate : public GreetingCardTemplate {
 protected:
     std::string occasion() override {
         return "Happy birthday!! Hope you have a wonderful day and lot of cake.";
     }
+    bool pastesNames() const override {
+        return true;
+    }
 };
 
 class PongalCardTemplate : public GreetingCardTemplate {
@@ -38,9 +199,75 @@ protected:
     std::string occasion() override {
         return "Happy Pongal!! Wish you and your family a wonderful day.";
     }
+    bool pastesNames() const override {
+        return true;
+    }
+};
+
+// A custom template that doesn't just paste the name in. It doesn't claim
+// pastesNames(), so compile() falls back to generate().
+class ShoutingCardTemplate : public GreetingCardTemplate {
+protected:
+    std::string intro(const std::string &to) override {
+        std::string loud = to;
+        for (auto &c : loud) {
+            c = std::toupper(static_cast<unsigned char>(c));
+        }
+        return "HEY " + loud + "!!!\n";
+    }
+};
+
+// Inherits pastesNames() from BirthdayCardTemplate but changes the name;
+// compile() has to notice and fall back to generate().
+class LoudBirthdayCardTemplate : public BirthdayCardTemplate {
+protected:
+    std::string intro(const std::string &to) override {
+        std::string loud = to;
+        for (auto &c : loud) {
+            c = std::toupper(static_cast<unsigned char>(c));
+        }
+        return "DEAR " + loud + "!!!\n";
+    }
 };
 
-int main() {
+// cards/sec for generate(), compiled render() and arena render()
+void benchmarkCards(GreetingCardTemplate &card, size_t count) {
+    CompiledGreetingCard compiled = card.compile();
+    std::vector<std::string> names = { "Bob", "Sashwin", "Ashwad", "Meenu" };
+    const std::string from = "Jane";
+    size_t bytes = 0;
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        bytes += card.generate(names[i % 4], from).size();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        bytes -= compiled.render(names[i % 4], from).size();
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    CardArena arena(1 << 20);
+    for (size_t i = 0; i < count; ++i) {
+        std::string_view rendered = compiled.render(names[i % 4], from, arena);
+        if (rendered.empty()) {
+            arena.reset();
+            rendered = compiled.render(names[i % 4], from, arena);
+        }
+        bytes += rendered.size();
+    }
+    auto t3 = std::chrono::steady_clock::now();
+
+    auto rate = [count](std::chrono::steady_clock::duration d) {
+        return count / std::chrono::duration<double>(d).count();
+    };
+    std::cout << "Rendering " << count << " cards:\n"
+              << "generate():       " << rate(t1 - t0) << " cards/sec\n"
+              << "compiled render:  " << rate(t2 - t1) << " cards/sec\n"
+              << "arena render:     " << rate(t3 - t2) << " cards/sec"
+              << " (" << bytes / count << " bytes/card)\n";
+}
+
+int main(int argc, char *argv[]) {
     GreetingCardTemplate gct;
     BirthdayCardTemplate bct;
     PongalCardTemplate pct;
@@ -50,7 +277,31 @@ int main() {
     std::cout << "Here's a birthday card:\n\n"
               << bct.generate("Sashwin", "Meenu") << std::endl;
     std::cout << "Here's Pongal card:\n\n"
-              << pct.generate("Ashwad", "Sashwin") << std::endl;    
+              << pct.generate("Ashwad", "Sashwin") << std::endl;
+
+    CompiledGreetingCard compiledBirthday = bct.compile();
+    std::cout << "Here's a precompiled birthday card:\n\n"
+              << compiledBirthday.render("Ashwad", "Meenu") << std::endl;
+    ShoutingCardTemplate sct;
+    CompiledGreetingCard compiledShouting = sct.compile();
+    std::cout << "Here's a shouting card ("
+              << (compiledShouting.isCompiled() ? "precompiled" : "generated") << "):\n\n"
+              << compiledShouting.render("Bob", "Jane") << std::endl;
+
+    // every template's compiled card must match what it generates
+    LoudBirthdayCardTemplate lbct;
+    GreetingCardTemplate *templates[] = { &gct, &bct, &pct, &sct, &lbct };
+    int mismatches = 0;
+    for (auto *t : templates) {
+        if (t->compile().render("Ashwad", "Meenu") != t->generate("Ashwad", "Meenu"))
+            mismatches++;
+    }
+    std::cout << "Compiled cards checked: " << mismatches << " mismatches, loud birthday card "
+              << (lbct.compile().isCompiled() ? "precompiled" : "generated") << "\n\n";
+    if (mismatches)
+        return 1;
+
+    benchmarkCards(pct, argc > 1 ? std::atol(argv[1]) : 1000000);
     return 0;
 }
 
@@ -65,40 +65,582 @@
 
 */
 #include <iostream>
+#include <string>
+#include <vector>
+#include <variant>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <string_view>
+#include <algorithm>
+#include <charconv>
+#include <unordered_map>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+class Person;
+class Landmark;
+class Car;
 
 class Visitor {
 public:
+    virtual ~Visitor() {}
     virtual void handlePerson(const std::string &name, int age) = 0;
     virtual void handleLandmark(const std::string &name, const std::string &cityName) = 0;
     virtual void handleCar(const std::string &name, const std::string &model) = 0;
+    // Whole arrays of one type at a time, used by TypedCollection. The
+    // defaults call handleX for each element; visitors that can do better
+    // with a homogeneous batch override them.
+    virtual void handlePeople(const std::vector<Person> &people);
+    virtual void handleLandmarks(const std::vector<Landmark> &landmarks);
+    virtual void handleCars(const std::vector<Car> &cars);
+};
+
+// Appends to a file from a background thread. Callers fill one buffer
+// while the other is being written; append() only waits when both are
+// full. Not thread-safe: one thread appends.
+class AsyncFileWriter {
+    int fd;
+    size_t capacity;
+    std::string front;                  // being filled by the caller
+    std::string back;                   // being written by the worker
+    bool backBusy = false;
+    bool stopping = false;
+    bool failed = false;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread worker;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            changed.wait(lock, [this] { return backBusy || stopping; });
+            if (!backBusy)
+                return;
+            lock.unlock();
+            bool ok = true;
+            for (size_t done = 0; done < back.size();) {
+                ssize_t n = ::write(fd, back.data() + done, back.size() - done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    ok = false;
+                    break;
+                }
+                done += n;
+            }
+            lock.lock();
+            if (!ok)
+                failed = true;
+            back.clear();
+            backBusy = false;
+            changed.notify_all();
+        }
+    }
+    void submit() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return !backBusy; });
+        std::swap(front, back);
+        backBusy = true;
+        changed.notify_all();
+    }
+public:
+    AsyncFileWriter(const std::string &path, bool truncate, size_t capacity = 1 << 20) :
+        capacity(capacity) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0644);
+        if (fd < 0) {
+            std::cerr << "Can't open " << path << " for writing\n";
+            failed = true;
+        }
+        front.reserve(capacity);
+        back.reserve(capacity);
+        worker = std::thread(&AsyncFileWriter::run, this);
+    }
+    ~AsyncFileWriter() {
+        commit(false);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            changed.notify_all();
+        }
+        worker.join();
+        if (fd >= 0)
+            close(fd);
+    }
+    AsyncFileWriter(const AsyncFileWriter &) = delete;
+    AsyncFileWriter &operator=(const AsyncFileWriter &) = delete;
+
+    void append(const char *data, size_t size) {
+        if (front.size() + size > capacity && !front.empty())
+            submit();
+        front.append(data, size);
+    }
+    // Waits until everything appended so far has reached the file, and
+    // with `sync` until it is on disk. Returns false if a write failed.
+    bool commit(bool sync) {
+        if (!front.empty())
+            submit();
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return !backBusy; });
+        if (sync && fd >= 0 && fdatasync(fd) != 0)
+            failed = true;
+        return !failed;
+    }
+};
+
+// An append-only file of records with a fixed binary layout: the file
+// starts with "VREC", then each record is a RecordHeader followed by the
+// name and the second field. Records are never changed once written. An
+// in-memory hash index maps names to record offsets; it is rebuilt by
+// scanning the file on open, which also drops a torn last record.
+class RecordStore {
+public:
+    enum Kind : uint8_t { PersonRecord, LandmarkRecord, CarRecord };
+    struct RecordHeader {
+        uint32_t size;                  // header + name + other
+        uint8_t kind;
+        uint8_t reserved;
+        uint16_t nameLength;
+        uint16_t otherLength;
+        uint16_t reserved2;
+        int32_t age;
+    };
+    struct Record {
+        Kind kind;
+        std::string name;
+        std::string other;              // city name or car model
+        int age;
+    };
+private:
+    static constexpr char magic[4] = { 'V', 'R', 'E', 'C' };
+    int fd = -1;                        // for reading records back
+    uint64_t end = 0;                   // offset of the next record
+    std::unordered_multimap<std::string, uint64_t> index;
+    AsyncFileWriter *writer = nullptr;
+    std::string record;
+
+    void scan(const std::string &path) {
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+            return;
+        uint64_t size = info.st_size;
+        if (size < sizeof(magic)) {
+            if (size > 0 && ftruncate(fd, 0) != 0)
+                std::cerr << "Can't reset " << path << "\n";
+            if (pwrite(fd, magic, sizeof(magic), 0) != sizeof(magic))
+                std::cerr << "Can't initialise " << path << "\n";
+            end = sizeof(magic);
+            return;
+        }
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Can't map " << path << "\n";
+            return;
+        }
+        const char *data = static_cast<const char*>(mapping);
+        if (std::memcmp(data, magic, sizeof(magic)) != 0) {
+            std::cerr << path << " is not a record store\n";
+            munmap(mapping, size);
+            return;
+        }
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        end = sizeof(magic);
+        while (size - end >= sizeof(RecordHeader)) {
+            RecordHeader header;
+            std::memcpy(&header, data + end, sizeof(header));
+            if (header.size != sizeof(header) + header.nameLength + header.otherLength ||
+                header.size > size - end)
+                break;
+            index.emplace(std::string(data + end + sizeof(header), header.nameLength), end);
+            end += header.size;
+        }
+        munmap(mapping, size);
+        if (end < size && ftruncate(fd, end) != 0)
+            std::cerr << "Can't drop the torn tail of " << path << "\n";
+    }
+public:
+    RecordStore(const std::string &path) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            std::cerr << "Can't open " << path << "\n";
+            return;
+        }
+        scan(path);
+        if (end)
+            writer = new AsyncFileWriter(path, false);
+    }
+    ~RecordStore() {
+        delete writer;
+        if (fd >= 0)
+            close(fd);
+    }
+    RecordStore(const RecordStore &) = delete;
+    RecordStore &operator=(const RecordStore &) = delete;
+
+    bool isOpen() const {
+        return writer != nullptr;
+    }
+    // Returns the number of bytes appended, 0 if the store isn't open or
+    // a field is longer than UINT16_MAX bytes.
+    size_t append(Kind kind, const std::string &name, const std::string &other, int age) {
+        if (!writer)
+            return 0;
+        if (name.size() > UINT16_MAX || other.size() > UINT16_MAX) {
+            std::cerr << "Record fields are limited to " << UINT16_MAX << " bytes, not storing "
+                      << name.substr(0, 32) << "...\n";
+            return 0;
+        }
+        RecordHeader header = {};
+        header.nameLength = static_cast<uint16_t>(name.size());
+        header.otherLength = static_cast<uint16_t>(other.size());
+        header.size = sizeof(header) + header.nameLength + header.otherLength;
+        header.kind = kind;
+        header.age = age;
+        record.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+        record.append(name, 0, header.nameLength);
+        record.append(other, 0, header.otherLength);
+        writer->append(record.data(), record.size());
+        index.emplace(record.substr(sizeof(header), header.nameLength), end);
+        end += header.size;
+        return header.size;
+    }
+    bool commit(bool sync) {
+        return writer && writer->commit(sync);
+    }
+    // Every record stored under `name`, oldest first.
+    std::vector<Record> find(const std::string &name) {
+        std::vector<Record> found;
+        if (!writer)
+            return found;
+        writer->commit(false);
+        auto range = index.equal_range(name);
+        std::vector<uint64_t> offsets;
+        for (auto it = range.first; it != range.second; ++it)
+            offsets.push_back(it->second);
+        std::sort(offsets.begin(), offsets.end());
+        for (uint64_t offset : offsets) {
+            RecordHeader header;
+            if (pread(fd, &header, sizeof(header), offset) != sizeof(header))
+                break;
+            std::string fields(header.nameLength + header.otherLength, '\0');
+            if (pread(fd, &fields[0], fields.size(), offset + sizeof(header)) !=
+                static_cast<ssize_t>(fields.size()))
+                break;
+            found.push_back(Record{ static_cast<Kind>(header.kind), fields.substr(0, header.nameLength),
+                                    fields.substr(header.nameLength), header.age });
+        }
+        return found;
+    }
+    uint64_t size() const {
+        return end;
+    }
+};
+
+// Counts what a persisting visitor has written, and commits every
+// `commitEvery` records (never, if 0) as well as when asked.
+class PersistingVisitor : public Visitor {
+    size_t commitEvery;
+    size_t uncommitted = 0;
+protected:
+    size_t recordCount = 0;
+    size_t byteCount = 0;
+
+    // `bytes` of 0 means nothing was stored, which isn't counted.
+    void written(size_t bytes) {
+        if (bytes == 0)
+            return;
+        recordCount++;
+        byteCount += bytes;
+        if (commitEvery && ++uncommitted >= commitEvery) {
+            commit();
+            uncommitted = 0;
+        }
+    }
+public:
+    PersistingVisitor(size_t commitEvery) : commitEvery(commitEvery) {}
+    virtual bool commit() = 0;
+    size_t records() const { return recordCount; }
+    size_t bytes() const { return byteCount; }
 };
 
-class DataBaseVisitor : public Visitor {
+class DataBaseVisitor : public PersistingVisitor {
+    RecordStore store;
 public:
+    DataBaseVisitor(const std::string &path, size_t commitEvery = 0) :
+        PersistingVisitor(commitEvery), store(path) {}
+    ~DataBaseVisitor() {
+        commit();
+    }
     void handlePerson(const std::string &name, int age) override {
-        std::cout << "Writing person to the database: " << name << ", " << age << std::endl;
+        written(store.append(RecordStore::PersonRecord, name, std::string(), age));
     }
     void handleLandmark(const std::string &name, const std::string &cityName) override {
-        std::cout << "Writing landmark to the database: " << name << ", " << cityName << std::endl;
+        written(store.append(RecordStore::LandmarkRecord, name, cityName, 0));
     }
     void handleCar(const std::string &make, const std::string &model) override {
-        std::cout << "Writing car to the database: " << make << ", " << model << std::endl;
+        written(store.append(RecordStore::CarRecord, make, model, 0));
+    }
+    bool commit() override {
+        return store.commit(false);
+    }
+    RecordStore &records() {
+        return store;
     }
 };
 
-class TextFileVisitor : public Visitor {
+// One line per element, e.g. "person: John, 39".
+class TextFileVisitor : public PersistingVisitor {
+    AsyncFileWriter writer;
+    std::string line;
+
+    void writeLine(const char *kind, const std::string &first, const std::string &second) {
+        line.assign(kind);
+        line += first;
+        line += ", ";
+        line += second;
+        line += '\n';
+        writer.append(line.data(), line.size());
+        written(line.size());
+    }
 public:
+    TextFileVisitor(const std::string &path, size_t commitEvery = 0) :
+        PersistingVisitor(commitEvery), writer(path, true) {}
     void handlePerson(const std::string &name, int age) override {
-        std::cout << "Writing person to the textfile: " << name << ", " << age << std::endl;
+        char digits[16];
+        auto result = std::to_chars(digits, digits + sizeof(digits), age);
+        writeLine("person: ", name, std::string(digits, result.ptr));
     }
     void handleLandmark(const std::string &name, const std::string &cityName) override {
-        std::cout << "Writing landmark to the textfile: " << name << ", " << cityName << std::endl;
+        writeLine("landmark: ", name, cityName);
     }
     void handleCar(const std::string &make, const std::string &model) override {
-        std::cout << "Writing car to the textfile: " << make << ", " << model << std::endl;
+        writeLine("car: ", make, model);
+    }
+    bool commit() override {
+        return writer.commit(false);
     }
 };
 
+// Length of the well-formed UTF-8 sequence at p, or 0 if it isn't one
+// (overlong forms, surrogates and code points past U+10FFFF included).
+size_t utf8SequenceLength(const unsigned char *p, const unsigned char *end) {
+    unsigned char lead = p[0];
+    size_t length;
+    unsigned char low = 0x80, high = 0xbf;    // allowed range of the second byte
+    if (lead < 0x80)
+        return 1;
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        length = 2;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+        length = 3;
+        if (lead == 0xe0) low = 0xa0;
+        if (lead == 0xed) high = 0x9f;
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        length = 4;
+        if (lead == 0xf0) low = 0x90;
+        if (lead == 0xf4) high = 0x8f;
+    } else {
+        return 0;
+    }
+    if (static_cast<size_t>(end - p) < length || p[1] < low || p[1] > high)
+        return 0;
+    for (size_t i = 2; i < length; ++i) {
+        if (p[i] < 0x80 || p[i] > 0xbf)
+            return 0;
+    }
+    return length;
+}
+
+// Appends [p, end) as the inside of a JSON string a byte at a time.
+// Quotes, backslashes and control characters are escaped, and bytes that
+// aren't valid UTF-8 become U+FFFD so the output is always valid JSON.
+void appendJsonEscapedScalar(std::string &out, const char *p, const char *end) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *u = reinterpret_cast<const unsigned char*>(p);
+    const unsigned char *uend = reinterpret_cast<const unsigned char*>(end);
+    while (u < uend) {
+        unsigned char c = *u;
+        if (c >= 0x80) {
+            size_t length = utf8SequenceLength(u, uend);
+            if (length) {
+                out.append(reinterpret_cast<const char*>(u), length);
+                u += length;
+            } else {
+                out += "\\ufffd";
+                u++;
+            }
+            continue;
+        }
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                char escape[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+                out.append(escape, sizeof(escape));
+            } else {
+                out += static_cast<char>(c);
+            }
+        }
+        u++;
+    }
+}
+
+// Same result as appendJsonEscapedScalar. With SSE2, runs of plain ASCII
+// that need no escaping are found 16 bytes at a time and copied in one go;
+// only the bytes that stop a run go through the scalar path.
+void appendJsonEscaped(std::string &out, std::string_view text) {
+    const char *p = text.data();
+    const char *end = p + text.size();
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i lastControl = _mm_set1_epi8(0x1f);
+    const char *run = p;
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                       _mm_cmpeq_epi8(chunk, backslash));
+        // unsigned c <= 0x1f
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_min_epu8(chunk, lastControl), chunk));
+        // the top bit marks non-ASCII bytes, which need UTF-8 checking
+        int mask = _mm_movemask_epi8(special) | _mm_movemask_epi8(chunk);
+        if (mask == 0) {
+            p += 16;
+            continue;
+        }
+        p += __builtin_ctz(mask);
+        out.append(run, p - run);
+        const unsigned char *u = reinterpret_cast<const unsigned char*>(p);
+        size_t length = *u >= 0x80 ? std::max<size_t>(1, utf8SequenceLength(u, reinterpret_cast<const unsigned char*>(end))) : 1;
+        appendJsonEscapedScalar(out, p, p + length);
+        p += length;
+        run = p;
+    }
+    out.append(run, p - run);
+#endif
+    appendJsonEscapedScalar(out, p, end);
+}
+
+// Writes visited elements as one JSON array, one object per line:
+//   {"type":"person","name":"John","age":39}
+// Objects are built in a growable buffer that is handed to an
+// AsyncFileWriter whenever it passes `chunkSize`. finish() (or the
+// destructor) closes the array; until then the file holds a prefix.
+// Elements visited after finish() are rejected and not written.
+class JsonVisitor : public PersistingVisitor {
+    AsyncFileWriter writer;
+    std::string buffer;
+    size_t chunkSize;
+    bool first = true;
+    bool finished = false;
+    size_t rejectedCount = 0;
+
+    // false, once the array is closed
+    bool accepting() {
+        if (!finished)
+            return true;
+        if (rejectedCount++ == 0)
+            std::cerr << "JsonVisitor: visit after finish() ignored\n";
+        return false;
+    }
+    void beginObject(const char *type) {
+        buffer += first ? "[\n{\"type\":\"" : ",\n{\"type\":\"";
+        buffer += type;
+        first = false;
+    }
+    void field(const char *name, const std::string &value) {
+        buffer += "\",\"";
+        buffer += name;
+        buffer += "\":\"";
+        appendJsonEscaped(buffer, value);
+    }
+    void endObject(size_t sizeBefore) {
+        written(buffer.size() - sizeBefore);
+        if (buffer.size() >= chunkSize)
+            flushBuffer();
+    }
+    void flushBuffer() {
+        writer.append(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+public:
+    JsonVisitor(const std::string &path, size_t commitEvery = 0, size_t chunkSize = 1 << 20) :
+        PersistingVisitor(commitEvery), writer(path, true), chunkSize(chunkSize) {
+        buffer.reserve(chunkSize + 4096);
+    }
+    ~JsonVisitor() {
+        finish();
+    }
+    void handlePerson(const std::string &name, int age) override {
+        if (!accepting())
+            return;
+        size_t before = buffer.size();
+        beginObject("person");
+        field("name", name);
+        buffer += "\",\"age\":";
+        char digits[16];
+        auto result = std::to_chars(digits, digits + sizeof(digits), age);
+        buffer.append(digits, result.ptr);
+        buffer += '}';
+        endObject(before);
+    }
+    void handleLandmark(const std::string &name, const std::string &cityName) override {
+        if (!accepting())
+            return;
+        size_t before = buffer.size();
+        beginObject("landmark");
+        field("name", name);
+        field("city", cityName);
+        buffer += "\"}";
+        endObject(before);
+    }
+    void handleCar(const std::string &make, const std::string &model) override {
+        if (!accepting())
+            return;
+        size_t before = buffer.size();
+        beginObject("car");
+        field("make", make);
+        field("model", model);
+        buffer += "\"}";
+        endObject(before);
+    }
+    bool commit() override {
+        flushBuffer();
+        return writer.commit(false);
+    }
+    // Closes the array. Nothing more can be visited afterwards.
+    bool finish() {
+        if (finished)
+            return true;
+        finished = true;
+        buffer += first ? "[]\n" : "\n]\n";
+        return commit();
+    }
+    // elements visited after finish()
+    size_t rejected() const {
+        return rejectedCount;
+    }
+};
 
 class Person {
     std::string name;
@@ -109,6 +651,12 @@ public:
     void accept(Visitor *v) {
         v->handlePerson(name, age);
     }
+    // Same as accept(), but bound at compile time when V is a
+    // concrete (final) visitor, so the handler can be inlined.
+    template <typename V>
+    void acceptDirect(V &v) const {
+        v.handlePerson(name, age);
+    }
 };
 
 class Landmark {
@@ -120,6 +668,10 @@ public:
     void accept(Visitor *v) {
         v->handleLandmark(name, cityName);
     }
+    template <typename V>
+    void acceptDirect(V &v) const {
+        v.handleLandmark(name, cityName);
+    }
 };
 
 class Car {
@@ -132,15 +684,472 @@ public:
         v->handleCar(make, model);
         
     }
+    template <typename V>
+    void acceptDirect(V &v) const {
+        v.handleCar(make, model);
+    }
+};
+
+// Common base for keeping a mixed set of elements behind pointers and
+// visiting them the classic way. The elements themselves stay plain
+// values; only this wrapper carries a vtable.
+class Visitable {
+public:
+    virtual ~Visitable() {}
+    virtual void accept(Visitor *v) = 0;
+};
+
+template <typename Element>
+class VisitableElement : public Visitable {
+    Element element;
+public:
+    VisitableElement(Element element) : element(std::move(element)) {}
+    void accept(Visitor *v) override {
+        element.accept(v);
+    }
+};
+
+void Visitor::handlePeople(const std::vector<Person> &people) {
+    for (auto &person : people)
+        person.acceptDirect(*this);
+}
+
+void Visitor::handleLandmarks(const std::vector<Landmark> &landmarks) {
+    for (auto &landmark : landmarks)
+        landmark.acceptDirect(*this);
+}
+
+void Visitor::handleCars(const std::vector<Car> &cars) {
+    for (auto &car : cars)
+        car.acceptDirect(*this);
+}
+
+static_assert(!std::is_polymorphic<Person>::value && !std::is_polymorphic<Landmark>::value &&
+              !std::is_polymorphic<Car>::value, "elements stored by value must not carry a vptr");
+
+// Mixed elements stored by value in one array, in insertion order.
+// visit() dispatches with std::visit; given a final visitor type the
+// handlers are called directly instead of through the vtable.
+class VariantCollection {
+public:
+    typedef std::variant<Person, Landmark, Car> Item;
+private:
+    std::vector<Item> items;
+public:
+    void add(Item item) {
+        items.push_back(std::move(item));
+    }
+    size_t size() const {
+        return items.size();
+    }
+    template <typename V>
+    void visit(V &visitor) const {
+        for (auto &item : items) {
+            std::visit([&visitor](const auto &element) { element.acceptDirect(visitor); }, item);
+        }
+    }
+};
+
+// Mixed elements kept in one contiguous array per type. A visitor sees all
+// the people, then all the landmarks, then all the cars, each as a single
+// batch, so this only suits visitors that don't care about the order
+// between types.
+class TypedCollection {
+    std::vector<Person> people;
+    std::vector<Landmark> landmarks;
+    std::vector<Car> cars;
+public:
+    void add(const Person &person) { people.push_back(person); }
+    void add(const Landmark &landmark) { landmarks.push_back(landmark); }
+    void add(const Car &car) { cars.push_back(car); }
+    size_t size() const {
+        return people.size() + landmarks.size() + cars.size();
+    }
+    void visit(Visitor &visitor) const {
+        visitor.handlePeople(people);
+        visitor.handleLandmarks(landmarks);
+        visitor.handleCars(cars);
+    }
+};
+
+// Cheap handlers, so the benchmark measures dispatch and memory layout
+// rather than the work done per element.
+class StatsVisitor final : public Visitor {
+public:
+    long long ages = 0;
+    size_t characters = 0;
+    size_t visited = 0;
+
+    void handlePerson(const std::string &name, int age) override {
+        ages += age;
+        characters += name.size();
+        visited++;
+    }
+    void handleLandmark(const std::string &name, const std::string &cityName) override {
+        characters += name.size() + cityName.size();
+        visited++;
+    }
+    void handleCar(const std::string &make, const std::string &model) override {
+        characters += make.size() + model.size();
+        visited++;
+    }
+    void handlePeople(const std::vector<Person> &people) override {
+        for (auto &person : people)
+            person.acceptDirect(*this);
+    }
+    void handleLandmarks(const std::vector<Landmark> &landmarks) override {
+        for (auto &landmark : landmarks)
+            landmark.acceptDirect(*this);
+    }
+    void handleCars(const std::vector<Car> &cars) override {
+        for (auto &car : cars)
+            car.acceptDirect(*this);
+    }
+    bool operator==(const StatsVisitor &other) const {
+        return ages == other.ages && characters == other.characters && visited == other.visited;
+    }
+};
+
+// items/sec over the same random mix of elements held three ways
+void benchmarkVisitors(size_t count, int rounds) {
+    std::vector<Visitable*> classic;
+    VariantCollection variants;
+    TypedCollection typed;
+    std::srand(2024);
+    for (size_t i = 0; i < count; ++i) {
+        std::string n = std::to_string(i);
+        switch (std::rand() % 3) {
+        case 0:
+            classic.push_back(new VisitableElement<Person>(Person("Person" + n, i % 100)));
+            variants.add(Person("Person" + n, i % 100));
+            typed.add(Person("Person" + n, i % 100));
+            break;
+        case 1:
+            classic.push_back(new VisitableElement<Landmark>(Landmark("Landmark" + n, "Bengaluru")));
+            variants.add(Landmark("Landmark" + n, "Bengaluru"));
+            typed.add(Landmark("Landmark" + n, "Bengaluru"));
+            break;
+        default:
+            classic.push_back(new VisitableElement<Car>(Car("Chevrolet", "Camaro" + n)));
+            variants.add(Car("Chevrolet", "Camaro" + n));
+            typed.add(Car("Chevrolet", "Camaro" + n));
+            break;
+        }
+    }
+
+    StatsVisitor classicStats, variantStats, typedStats;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (auto element : classic)
+            element->accept(&classicStats);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+        variants.visit(variantStats);
+    auto t2 = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+        typed.visit(typedStats);
+    auto t3 = std::chrono::steady_clock::now();
+
+    auto rate = [count, rounds](std::chrono::steady_clock::duration d) {
+        return count * rounds / std::chrono::duration<double>(d).count();
+    };
+    std::cout << "\nVisiting " << count << " mixed elements " << rounds << " times:\n"
+              << "virtual accept:    " << rate(t1 - t0) << " items/sec\n"
+              << "std::variant:      " << rate(t2 - t1) << " items/sec\n"
+              << "per-type batches:  " << rate(t3 - t2) << " items/sec"
+              << (classicStats == variantStats && classicStats == typedStats ? "" : " (results differ!)")
+              << std::endl;
+
+    for (auto element : classic)
+        delete element;
+}
+
+// Strict RFC 8259 checker used to validate JsonVisitor's output.
+class JsonChecker {
+    const char *p;
+    const char *end;
+
+    void skipSpace() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            ++p;
+    }
+    bool literal(const char *word) {
+        size_t length = std::strlen(word);
+        if (static_cast<size_t>(end - p) < length || std::memcmp(p, word, length) != 0)
+            return false;
+        p += length;
+        return true;
+    }
+    bool digits() {
+        const char *start = p;
+        while (p < end && *p >= '0' && *p <= '9')
+            ++p;
+        return p > start;
+    }
+    bool number() {
+        if (p < end && *p == '-')
+            ++p;
+        if (p < end && *p == '0')
+            ++p;
+        else if (p == end || *p < '1' || *p > '9' || !digits())
+            return false;
+        if (p < end && *p == '.' && (++p, !digits()))
+            return false;
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            ++p;
+            if (p < end && (*p == '+' || *p == '-'))
+                ++p;
+            if (!digits())
+                return false;
+        }
+        return true;
+    }
+    bool string() {
+        if (p == end || *p != '"')
+            return false;
+        ++p;
+        while (p < end && *p != '"') {
+            unsigned char c = *p;
+            if (c < 0x20)
+                return false;
+            if (c == '\\') {
+                if (++p == end)
+                    return false;
+                if (*p == 'u') {
+                    for (int i = 0; i < 4; ++i) {
+                        if (++p == end || !std::isxdigit(static_cast<unsigned char>(*p)))
+                            return false;
+                    }
+                } else if (!std::strchr("\"\\/bfnrt", *p)) {
+                    return false;
+                }
+                ++p;
+            } else {
+                size_t length = utf8SequenceLength(reinterpret_cast<const unsigned char*>(p),
+                                                   reinterpret_cast<const unsigned char*>(end));
+                if (length == 0)
+                    return false;
+                p += length;
+            }
+        }
+        if (p == end)
+            return false;
+        ++p;
+        return true;
+    }
+    bool value(int depth) {
+        if (depth > 512)
+            return false;
+        skipSpace();
+        if (p == end)
+            return false;
+        switch (*p) {
+        case '{':
+        case '[': {
+            char close = *p == '{' ? '}' : ']';
+            bool isObject = close == '}';
+            ++p;
+            skipSpace();
+            if (p < end && *p == close) {
+                ++p;
+                return true;
+            }
+            for (;;) {
+                if (isObject) {
+                    skipSpace();
+                    if (!string())
+                        return false;
+                    skipSpace();
+                    if (p == end || *p++ != ':')
+                        return false;
+                }
+                if (!value(depth + 1))
+                    return false;
+                skipSpace();
+                if (p == end)
+                    return false;
+                if (*p == close) {
+                    ++p;
+                    return true;
+                }
+                if (*p++ != ',')
+                    return false;
+            }
+        }
+        case '"':
+            return string();
+        case 't':
+            return literal("true");
+        case 'f':
+            return literal("false");
+        case 'n':
+            return literal("null");
+        default:
+            return number();
+        }
+    }
+public:
+    static bool isValid(std::string_view text) {
+        JsonChecker checker;
+        checker.p = text.data();
+        checker.end = text.data() + text.size();
+        if (!checker.value(0))
+            return false;
+        checker.skipSpace();
+        return checker.p == checker.end;
+    }
 };
 
-int main () {
+// JsonVisitor's output has to be valid JSON for awkward input too, and
+// the SIMD escaper has to agree with the scalar one. Returns the number
+// of failures.
+int checkJsonVisitor(const std::string &path) {
+    std::vector<std::string> names = {
+        "", "plain", "quote\" and \\ backslash", "tab\tnew\nline\r\b\f",
+        std::string("nul\0byte", 8), "\x01\x1f\x7f", "Chennai \xe0\xae\x9a\xe0\xaf\x86",
+        "bad utf8 \xff\xc0\xaf \xed\xa0\x80 \xf4\x90\x80\x80 end",
+        "cut \xe0\xae", "emoji \xf0\x9f\x8e\x82 and a long run of plain text to cross sixteen bytes \"",
+        std::string(100, 'x') + "\\" + std::string(17, '\x1b') + std::string(40, 'y'),
+    };
+    int failures = 0;
+    for (auto &name : names) {
+        std::string simd, scalar;
+        appendJsonEscaped(simd, name);
+        appendJsonEscapedScalar(scalar, name.data(), name.data() + name.size());
+        if (simd != scalar)
+            failures++;
+    }
+    for (int empty = 0; empty < 2; ++empty) {
+        {
+            JsonVisitor json(path, 0, 64);
+            for (size_t i = 0; !empty && i < names.size(); ++i) {
+                json.handlePerson(names[i], static_cast<int>(i) - 5);
+                json.handleLandmark(names[i], names[names.size() - 1 - i]);
+                json.handleCar(names[i], "Camaro");
+            }
+            // the document is closed: these must not reach the file
+            size_t records = json.records();
+            json.finish();
+            json.handlePerson("late", 1);
+            json.handleCar("late", "Camaro");
+            if (json.rejected() != 2 || json.records() != records || !json.finish())
+                failures++;
+        }
+        std::ifstream in(path, std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (!JsonChecker::isValid(text))
+            failures++;
+    }
+    const char *invalid[] = { "[", "{\"a\":}", "[1,]", "\"\x01\"", "\"\\x\"", "01", "[] []", "\"\xc0\xaf\"" };
+    for (auto text : invalid) {
+        if (JsonChecker::isValid(text))
+            failures++;
+    }
+    std::remove(path.c_str());
+    return failures;
+}
+
+// MB/sec of escaping mostly-plain strings, SIMD path vs scalar
+void benchmarkJsonEscaping(size_t bytes) {
+    std::string text;
+    while (text.size() < bytes)
+        text += "Chevrolet Camaro parked at LaCasa, Bengaluru \"quoted\"\n";
+    std::string out;
+    out.reserve(text.size() * 2);
+    auto t0 = std::chrono::steady_clock::now();
+    appendJsonEscapedScalar(out, text.data(), text.data() + text.size());
+    auto t1 = std::chrono::steady_clock::now();
+    size_t scalarSize = out.size();
+    out.clear();
+    appendJsonEscaped(out, text);
+    auto t2 = std::chrono::steady_clock::now();
+    auto rate = [&text](std::chrono::steady_clock::duration d) {
+        return text.size() / std::chrono::duration<double>(d).count() / (1 << 20);
+    };
+    std::cout << "\nEscaping " << text.size() / (1 << 20) << " MB for JSON:\n"
+              << "scalar: " << rate(t1 - t0) << " MB/sec\n"
+              << "simd:   " << rate(t2 - t1) << " MB/sec"
+              << (out.size() == scalarSize ? "" : " (results differ!)") << std::endl;
+}
+
+// records/sec and bytes/sec through the persisting visitors, committing
+// every `commitEvery` records
+void benchmarkPersistence(size_t count, size_t commitEvery, const std::string &prefix) {
+    std::vector<Visitable*> elements;
+    std::string someone = "nobody";
+    int someAge = 0;
+    std::srand(7);
+    for (size_t i = 0; i < count; ++i) {
+        std::string n = std::to_string(i);
+        switch (std::rand() % 3) {
+        case 0:
+            elements.push_back(new VisitableElement<Person>(Person("Person" + n, i % 100)));
+            if (i <= count / 2) {
+                someone = "Person" + n;
+                someAge = i % 100;
+            }
+            break;
+        case 1: elements.push_back(new VisitableElement<Landmark>(Landmark("Landmark" + n, "Bengaluru"))); break;
+        default: elements.push_back(new VisitableElement<Car>(Car("Chevrolet", "Camaro" + n))); break;
+        }
+    }
+    std::cout << "\nPersisting " << count << " elements, committing every "
+              << commitEvery << ":\n";
+    const char *names[] = { "text file: ", "record store: ", "json: " };
+    const char *extensions[] = { ".txt", ".db", ".json" };
+    for (int i = 0; i < 3; ++i) {
+        std::string path = prefix + extensions[i];
+        std::remove(path.c_str());
+        PersistingVisitor *visitor;
+        if (i == 0)
+            visitor = new TextFileVisitor(path, commitEvery);
+        else if (i == 1)
+            visitor = new DataBaseVisitor(path, commitEvery);
+        else
+            visitor = new JsonVisitor(path, commitEvery);
+        auto start = std::chrono::steady_clock::now();
+        for (auto element : elements)
+            element->accept(visitor);
+        visitor->commit();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << names[i] << visitor->records() / elapsed.count() << " records/sec, "
+                  << visitor->bytes() / elapsed.count() / (1 << 20) << " MB/sec" << std::endl;
+        delete visitor;
+        if (i == 1) {
+            // reopen: the index is rebuilt from the file
+            RecordStore store(path);
+            auto found = store.find(someone);
+            bool ok = found.size() == 1 && found[0].age == someAge;
+            std::cout << "reopened store: " << store.size() << " bytes, "
+                      << store.find("Chevrolet").size() << " Chevrolets, " << someone
+                      << (ok ? " found" : " NOT found") << std::endl;
+        }
+        std::remove(path.c_str());
+    }
+    for (auto element : elements)
+        delete element;
+}
+
+int main (int argc, char *argv[]) {
     Person person1("John", 39);
     Landmark landmark1("LaCasa", "Bengaluru");
     Car car1("Chevrolet", "Camaro");
 
-    DataBaseVisitor *dbv = new DataBaseVisitor;
-    TextFileVisitor *tfv = new TextFileVisitor;
+    // files go to argv[2] + ".db" etc., or into a fresh directory under /tmp
+    char directory[] = "/tmp/visitorXXXXXX";
+    std::string prefix;
+    if (argc > 2) {
+        prefix = argv[2];
+    } else if (mkdtemp(directory)) {
+        prefix = std::string(directory) + "/records";
+    } else {
+        std::cerr << "Can't create a temporary directory\n";
+        return 1;
+    }
+    std::remove((prefix + ".db").c_str());
+    DataBaseVisitor *dbv = new DataBaseVisitor(prefix + ".db");
+    TextFileVisitor *tfv = new TextFileVisitor(prefix + ".txt");
 
     person1.accept(dbv);
     landmark1.accept(dbv);
@@ -150,9 +1159,47 @@ int main () {
     landmark1.accept(tfv);
     car1.accept(tfv);
 
+    VariantCollection variants;
+    variants.add(person1);
+    variants.add(landmark1);
+    variants.add(car1);
+    variants.visit(*tfv);
+
+    TypedCollection typed;
+    typed.add(car1);
+    typed.add(person1);
+    typed.add(landmark1);
+    typed.visit(*dbv);
+
+    tfv->commit();
+    std::ifstream text(prefix + ".txt");
+    std::cout << "Text file:\n" << text.rdbuf();
+    std::cout << "Database records named John: ";
+    for (auto &record : dbv->records().find("John"))
+        std::cout << record.name << " (" << record.age << ") ";
+    std::cout << std::endl;
+    size_t stored = dbv->records().size();
+    Person(std::string(UINT16_MAX + 1, 'x'), 1).accept(dbv);
+    std::cout << "Oversized name " << (dbv->records().size() == stored ? "rejected" : "STORED")
+              << ", " << dbv->PersistingVisitor::records() << " records counted" << std::endl;
+    DataBaseVisitor unopened(prefix + ".missing/records.db");
+    person1.accept(&unopened);
+    std::cout << "Store that didn't open counted " << unopened.PersistingVisitor::records()
+              << " records" << std::endl;
+
     delete dbv;
     delete tfv;
-    
+    std::remove((prefix + ".db").c_str());
+    std::remove((prefix + ".txt").c_str());
+
+    size_t count = argc > 1 ? std::atol(argv[1]) : 1000000;
+    benchmarkVisitors(count, 10);
+    int jsonFailures = checkJsonVisitor(prefix + ".json");
+    std::cout << "\nJSON check failures: " << jsonFailures << std::endl;
+    benchmarkPersistence(count, 10000, prefix);
+    benchmarkJsonEscaping(64 << 20);
+    if (argc <= 2)
+        rmdir(directory);
     return 0;
 }
 